@@ -0,0 +1,146 @@
+#include "kv-over-messy-room.h"
+#include "bench-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Benchmarks of the key-value store: filling it, opening it and mixes of
+ * reads, writes and deletes over random keys.
+ */
+
+static const size_t value_sizes[] = {16, 256, 4095};
+#define NUMBER_OF_VALUE_SIZES (sizeof(value_sizes) / sizeof(size_t))
+
+#define MIN_KEYS  1000
+#define MIX_OPS   100000
+
+typedef struct {
+	const char* name;
+	unsigned int get; // Percents of each operation
+	unsigned int put;
+	unsigned int del;
+} mix_t;
+
+static const mix_t mixes[] = {
+	{"read_mostly", 90, 5, 5},
+	{"mixed", 50, 40, 10},
+	{"write_mostly", 10, 80, 10},
+};
+#define NUMBER_OF_MIXES (sizeof(mixes) / sizeof(mix_t))
+
+typedef struct {
+	size_t keys;
+	size_t value_size;
+	const mix_t* mix;
+} kv_params_t;
+
+static uint64_t random_state = 0x9E3779B97F4A7C15;
+
+static uint64_t next_random(void) {
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return random_state * 0x2545F4914F6CDD1D;
+}
+
+/*
+ * Make a data base of keys keys, timing each write if histogram is not NULL.
+ */
+static kvomr_db_t* fill_db(const kv_params_t* params, bench_histogram_t* histogram) {
+	kvomr_db_t* db = kvomr_open(mr_new());
+	char* value = malloc(params->value_size + 1);
+	memset(value, 'v', params->value_size);
+	value[params->value_size] = 0;
+	char key[32];
+	for (size_t i=0; i<params->keys; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		uint64_t start = histogram == NULL ? 0 : bench_now();
+		kvomr_write(db, key, value);
+		if (histogram != NULL) {
+			bench_record(histogram, bench_now() - start);
+		}
+	}
+	free(value);
+	return db;
+}
+
+static void fill_workload(void* arg) {
+	const kv_params_t* params = arg;
+	static bench_histogram_t histogram;
+	uint64_t start = bench_now();
+	fill_db(params, &histogram);
+	uint64_t ns = bench_now() - start;
+	bench_report("kv_fill", &histogram, ns, params->keys * params->value_size, "\"keys\": %zu, \"value_size\": %zu", params->keys, params->value_size);
+}
+
+static void open_workload(void* arg) {
+	const kv_params_t* params = arg;
+	kvomr_db_t* db = fill_db(params, NULL);
+	mr_heaplet_t* heaplet = kvomr_compact(db);
+	static bench_histogram_t histogram;
+	uint64_t total = 0;
+	for (int i=0; i<10; i++) {
+		uint64_t start = bench_now();
+		kvomr_close(kvomr_open(heaplet));
+		uint64_t ns = bench_now() - start;
+		bench_record(&histogram, ns);
+		total += ns;
+	}
+	bench_report("kv_open", &histogram, total, histogram.ops * params->keys * params->value_size, "\"keys\": %zu, \"value_size\": %zu", params->keys, params->value_size);
+}
+
+static void mix_workload(void* arg) {
+	const kv_params_t* params = arg;
+	kvomr_db_t* db = fill_db(params, NULL);
+	char* value = malloc(params->value_size + 1);
+	memset(value, 'w', params->value_size);
+	value[params->value_size] = 0;
+	char key[32];
+	static bench_histogram_t histogram;
+	uint64_t bytes = 0;
+	uint64_t start = bench_now();
+	for (size_t i=0; i<MIX_OPS; i++) {
+		snprintf(key, sizeof(key), "key%llu", (unsigned long long) (next_random() % params->keys));
+		unsigned int operation = next_random() % 100;
+		uint64_t op_start = bench_now();
+		if (operation < params->mix->get) {
+			char* read = kvomr_read(db, key);
+			bytes += read == NULL ? 0 : params->value_size;
+		} else if (operation < params->mix->get + params->mix->put) {
+			kvomr_write(db, key, value);
+			bytes += params->value_size;
+		} else {
+			kvomr_delete(db, key);
+		}
+		bench_record(&histogram, bench_now() - op_start);
+	}
+	uint64_t ns = bench_now() - start;
+	bench_report("kv_mix", &histogram, ns, bytes, "\"mix\": \"%s\", \"keys\": %zu, \"value_size\": %zu", params->mix->name, params->keys, params->value_size);
+}
+
+int main(int argc, char** argv) {
+	bench_options_t options;
+	if (!bench_parse_options(argc, argv, &options)) {
+		fprintf(stderr, "Usage: %s [--max-items N] [--max-bytes N] [--only BENCHMARK]\n", argv[0]);
+		return 1;
+	}
+	bench_begin();
+	for (size_t s=0; s<NUMBER_OF_VALUE_SIZES; s++) {
+		for (size_t keys=MIN_KEYS; keys<=options.max_items && keys * (value_sizes[s] + 32) <= options.max_bytes; keys*=10) {
+			kv_params_t params = {keys, value_sizes[s], NULL};
+			if (bench_selected(&options, "kv_fill")) {
+				bench_run(fill_workload, &params);
+			}
+			if (bench_selected(&options, "kv_open")) {
+				bench_run(open_workload, &params);
+			}
+			for (size_t m=0; m<NUMBER_OF_MIXES && bench_selected(&options, "kv_mix"); m++) {
+				params.mix = &mixes[m];
+				bench_run(mix_workload, &params);
+			}
+		}
+	}
+	bench_end();
+	return 0;
+}
@@ -0,0 +1,224 @@
+#include "kv-log.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+/*
+ * Changes made to a data base since its room file has been written are
+ * appended to a log file. Each record is:
+ *   type (1 byte, 'P' for a put or 'D' for a delete)
+ *   key length (2 bytes, little endian)
+ *   value length (2 bytes, little endian, 0 for a delete)
+ *   key and value, without their terminating null bytes
+ *   checksum of all the above (4 bytes, little endian)
+ * A record which is cut or whose checksum is wrong, as left by a crash in the
+ * middle of a write, ends the log. A process writing to the log holds an
+ * exclusive lock on it from before it reads the room file until it is done,
+ * so there is only one writer and checkpoints don't drop records.
+ */
+#define LOG_PUT 'P'
+#define LOG_DEL 'D'
+#define LOG_HEADER_SIZE 5
+#define LOG_CHECKSUM_SIZE 4
+#define LOG_MAX_RECORD (LOG_HEADER_SIZE + K_SIZE + V_SIZE + LOG_CHECKSUM_SIZE)
+
+struct kvomr_log_s {
+	int fd;
+	unsigned int sync_every; // Records written between two fsync, 0 to only sync on demand
+	unsigned int unsynced;
+};
+
+/*
+ * Checksum of a record, FNV-1a.
+ */
+static uint32_t record_checksum(const unsigned char* record, size_t size) {
+	uint32_t ret = 0x811C9DC5;
+	for (size_t i=0; i<size; i++) {
+		ret ^= record[i];
+		ret *= 0x01000193;
+	}
+	return ret;
+}
+
+/*
+ * Replay the records of a log over a data base. Return the size of the valid
+ * part of the log.
+ */
+static off_t replay(int fd, kvomr_db_t* db) {
+	FILE* f = fdopen(dup(fd), "r");
+	if (f == NULL) {
+		return 0;
+	}
+	off_t ret = 0;
+	unsigned char record[LOG_MAX_RECORD];
+	while (fread(record, 1, LOG_HEADER_SIZE, f) == LOG_HEADER_SIZE) {
+		size_t k_size = record[1] | (record[2] << 8);
+		size_t v_size = record[3] | (record[4] << 8);
+		if ((record[0] != LOG_PUT && record[0] != LOG_DEL) || k_size == 0 || k_size > K_SIZE || v_size > V_SIZE) {
+			break;
+		}
+		size_t size = LOG_HEADER_SIZE + k_size + v_size;
+		if (fread(record + LOG_HEADER_SIZE, 1, k_size + v_size + LOG_CHECKSUM_SIZE, f) != k_size + v_size + LOG_CHECKSUM_SIZE) {
+			break;
+		}
+		uint32_t checksum = record[size] | (record[size + 1] << 8) | (record[size + 2] << 16) | ((uint32_t) record[size + 3] << 24);
+		if (checksum != record_checksum(record, size)) {
+			break;
+		}
+		char k[K_SIZE + 1];
+		char v[V_SIZE + 1];
+		memcpy(k, record + LOG_HEADER_SIZE, k_size);
+		k[k_size] = 0;
+		memcpy(v, record + LOG_HEADER_SIZE + k_size, v_size);
+		v[v_size] = 0;
+		if (strlen(k) != k_size || strlen(v) != v_size) { // No null bytes inside
+			break;
+		}
+		if (record[0] == LOG_PUT) {
+			kvomr_write(db, k, v);
+		} else {
+			kvomr_delete(db, k);
+		}
+		ret += size + LOG_CHECKSUM_SIZE;
+	}
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Replay the log of a data base without changing it. A missing log is an
+ * empty one.
+ */
+void kvomr_log_replay(const char* path, kvomr_db_t* db) {
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		replay(fd, db);
+		close(fd);
+	}
+}
+
+/*
+ * Open the log of a data base to write to it, creating it if needed, and
+ * lock it, waiting for the other writers to be done. It must be opened
+ * before the room file is read. An fsync is done every sync_every records,
+ * or only with kvomr_log_sync and kvomr_log_close if it is 0. Return NULL on
+ * error.
+ */
+kvomr_log_t* kvomr_log_open(const char* path, unsigned int sync_every) {
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error, unable to open %s\n", path);
+		return NULL;
+	}
+	if (flock(fd, LOCK_EX)) {
+		fprintf(stderr, "Error, unable to lock %s\n", path);
+		close(fd);
+		return NULL;
+	}
+	kvomr_log_t* log = malloc(sizeof(kvomr_log_t));
+	log->fd = fd;
+	log->sync_every = sync_every;
+	log->unsynced = 0;
+	return log;
+}
+
+/*
+ * Replay an open log over the data base read after it has been opened. A cut
+ * record left at its end is removed so that new records follow the valid
+ * ones.
+ */
+bool kvomr_log_load(kvomr_log_t* log, kvomr_db_t* db) {
+	off_t valid_size = replay(log->fd, db);
+	struct stat st;
+	if (fstat(log->fd, &st) || (st.st_size != valid_size && ftruncate(log->fd, valid_size))) {
+		fprintf(stderr, "Error, unable to repair the log\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Append a record to the log in a single write.
+ */
+static bool append(kvomr_log_t* log, char type, const char* k, const char* v) {
+	size_t k_size = strlen(k);
+	size_t v_size = strlen(v);
+	unsigned char record[LOG_MAX_RECORD];
+	record[0] = type;
+	record[1] = k_size & 0xFF;
+	record[2] = k_size >> 8;
+	record[3] = v_size & 0xFF;
+	record[4] = v_size >> 8;
+	memcpy(record + LOG_HEADER_SIZE, k, k_size);
+	memcpy(record + LOG_HEADER_SIZE + k_size, v, v_size);
+	size_t size = LOG_HEADER_SIZE + k_size + v_size;
+	uint32_t checksum = record_checksum(record, size);
+	for (int i=0; i<LOG_CHECKSUM_SIZE; i++) {
+		record[size + i] = (checksum >> (8 * i)) & 0xFF;
+	}
+	size += LOG_CHECKSUM_SIZE;
+	if (write(log->fd, record, size) != (ssize_t) size) {
+		fprintf(stderr, "Error, unable to write to the log\n");
+		return false;
+	}
+	log->unsynced++;
+	if (log->sync_every != 0 && log->unsynced >= log->sync_every) {
+		return kvomr_log_sync(log);
+	}
+	return true;
+}
+
+/*
+ * Log the writing of a value at a key.
+ */
+bool kvomr_log_put(kvomr_log_t* log, const char* k, const char* v) {
+	return append(log, LOG_PUT, k, v);
+}
+
+/*
+ * Log the deletion of a key.
+ */
+bool kvomr_log_del(kvomr_log_t* log, const char* k) {
+	return append(log, LOG_DEL, k, "");
+}
+
+/*
+ * Make sure that all the records written are on disk.
+ */
+bool kvomr_log_sync(kvomr_log_t* log) {
+	if (log->unsynced == 0) {
+		return true;
+	}
+	if (fsync(log->fd)) {
+		fprintf(stderr, "Error, unable to sync the log\n");
+		return false;
+	}
+	log->unsynced = 0;
+	return true;
+}
+
+/*
+ * Empty the log, once its changes are in the room file.
+ */
+bool kvomr_log_truncate(kvomr_log_t* log) {
+	if (ftruncate(log->fd, 0) || fsync(log->fd)) {
+		fprintf(stderr, "Error, unable to truncate the log\n");
+		return false;
+	}
+	log->unsynced = 0;
+	return true;
+}
+
+/*
+ * Sync and close the log, which releases its lock.
+ */
+void kvomr_log_close(kvomr_log_t* log) {
+	kvomr_log_sync(log);
+	close(log->fd);
+	free(log);
+}
@@ -0,0 +1,19 @@
+#ifndef KV_LOG
+#define KV_LOG
+
+#include "kv-over-messy-room.h"
+#include <stdbool.h>
+
+typedef struct kvomr_log_s kvomr_log_t;
+
+void kvomr_log_replay(const char* path, kvomr_db_t* db);
+kvomr_log_t* kvomr_log_open(const char* path, unsigned int sync_every);
+bool kvomr_log_load(kvomr_log_t* log, kvomr_db_t* db);
+bool kvomr_log_put(kvomr_log_t* log, const char* k, const char* v);
+bool kvomr_log_del(kvomr_log_t* log, const char* k);
+bool kvomr_log_sync(kvomr_log_t* log);
+bool kvomr_log_truncate(kvomr_log_t* log);
+void kvomr_log_close(kvomr_log_t* log);
+
+#endif
+
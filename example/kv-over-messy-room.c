@@ -2,145 +2,400 @@
 #include <stdint.h>
 #include <string.h>
 
+/*
+ * Elements written by the first versions, of a fixed size. They are still
+ * read, and updated in place while their value fits.
+ */
+#define LEGACY_SIZE 255
 typedef struct {
-	char key[K_SIZE + 1];
-	char value[K_SIZE + 1];
+	char key[LEGACY_SIZE + 1];
+	char value[LEGACY_SIZE + 1];
 } kv_t;
 
 /*
- * Search for the kv element with the corresponding key.
- * Assumes that the key is not too big.
- * Returns it if found and NULL if not.
+ * Elements are now records of variable size:
+ *   tag (1 byte, KV_TAG)
+ *   key size (1 byte)
+ *   value capacity (2 bytes, little endian)
+ *   key and its null byte, the key being empty once deleted
+ *   value and its null byte, in value capacity + 1 bytes
+ * Records are rounded up to KV_ALIGN bytes, the extra bytes going to the value
+ * capacity so that a growing value can often be updated in place. No record
+ * is as big as a kv_t, which tells them apart.
+ */
+#define KV_TAG 0xCE
+#define KV_HEADER_SIZE 4
+#define KV_ALIGN 8
+
+/*
+ * Deleted records are kept to be reused in free lists by size class. The
+ * records in class c have at least 2^c bytes for their key and value.
+ */
+#define KV_CLASSES 16
+
+typedef struct {
+	char** records;
+	size_t count;
+	size_t capacity;
+} kv_free_list_t;
+
+/*
+ * A slot of the index. Empty slots have no element.
+ */
+typedef struct {
+	uint64_t hash;
+	char* element;
+	bool legacy; // The element is a kv_t rather than a record
+} kv_slot_t;
+
+/*
+ * A data base opened over a messy room. Elements are found through an open
+ * addressing hash index of their keys, with linear probing.
  */
-static kv_t* get_from_key(mr_heaplet_t* heaplet, const char* k) {
-	struct crawler_arg_s {
-		const char* key;
-		kv_t* element;
-	};
+struct kvomr_db_s {
+	mr_heaplet_t* heaplet;
+	kv_slot_t* slots;
+	size_t capacity; // Always a power of 2
+	size_t count;
+	kv_free_list_t free_lists[KV_CLASSES];
+};
+
+#define KV_MIN_CAPACITY 64
+
+/*
+ * Hash a key with FNV-1a.
+ */
+static uint64_t hash_key(const char* k) {
+	uint64_t ret = 0xCBF29CE484222325;
+	for (; *k; k++) {
+		ret ^= (unsigned char) *k;
+		ret *= 0x100000001B3;
+	}
+	return ret;
+}
+
+static char* element_key(const char* element, bool legacy) {
+	return (char*) (legacy ? element : element + KV_HEADER_SIZE);
+}
+
+static char* element_value(const char* element, bool legacy) {
+	if (legacy) {
+		return (char*) element + LEGACY_SIZE + 1;
+	}
+	return (char*) element + KV_HEADER_SIZE + (unsigned char) element[1] + 1;
+}
+
+static size_t value_capacity(const char* element, bool legacy) {
+	if (legacy) {
+		return LEGACY_SIZE;
+	}
+	return (unsigned char) element[2] | (unsigned char) element[3] << 8;
+}
 
-	int key_searcher(uint64_t size, char* data, void* extra_args) {
-		if (size != sizeof(kv_t)) {
-			return 0;
+/*
+ * Bytes of a record for its key, its value and their null bytes.
+ */
+static size_t record_space(const char* record) {
+	return (unsigned char) record[1] + 1 + value_capacity(record, false) + 1;
+}
+
+/*
+ * Tell if an element of a given size is a record.
+ */
+static bool is_record(uint64_t size, const char* data) {
+	return size >= KV_HEADER_SIZE && (unsigned char) data[0] == KV_TAG && KV_HEADER_SIZE + record_space(data) <= size;
+}
+
+/*
+ * Write the header, key and value of a record with space bytes for them.
+ */
+static void fill_record(char* record, size_t space, const char* k, const char* v) {
+	size_t k_size = strlen(k);
+	size_t capacity = space - (k_size + 1) - 1;
+	record[0] = (char) KV_TAG;
+	record[1] = k_size;
+	record[2] = capacity & 0xFF;
+	record[3] = capacity >> 8;
+	memcpy(record + KV_HEADER_SIZE, k, k_size + 1);
+	strcpy(element_value(record, false), v);
+}
+
+/*
+ * Return the slot of the index where a key is, or the empty slot where it
+ * would go.
+ */
+static kv_slot_t* find_slot(const kvomr_db_t* db, const char* k, uint64_t hash) {
+	size_t mask = db->capacity - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		kv_slot_t* slot = &db->slots[i];
+		if (slot->element == NULL || (slot->hash == hash && !strcmp(element_key(slot->element, slot->legacy), k))) {
+			return slot;
+		}
+	}
+}
+
+/*
+ * Put an element in the index, which must not already contain its key. The
+ * index is kept at most half full.
+ */
+static void index_element(kvomr_db_t* db, char* element, bool legacy, uint64_t hash) {
+	if (2 * (db->count + 1) > db->capacity) {
+		kv_slot_t* old_slots = db->slots;
+		size_t old_capacity = db->capacity;
+		db->capacity = old_capacity == 0 ? KV_MIN_CAPACITY : old_capacity * 2;
+		db->slots = calloc(db->capacity, sizeof(kv_slot_t));
+		for (size_t i=0; i<old_capacity; i++) {
+			if (old_slots[i].element != NULL) {
+				*find_slot(db, element_key(old_slots[i].element, old_slots[i].legacy), old_slots[i].hash) = old_slots[i];
+			}
 		}
-		struct crawler_arg_s* arg = extra_args;
-		kv_t* element = (kv_t*) data;
-		if (strcmp(element->key, arg->key)) {
-			return 0;
+		free(old_slots);
+	}
+	kv_slot_t* slot = find_slot(db, element_key(element, legacy), hash);
+	slot->hash = hash;
+	slot->element = element;
+	slot->legacy = legacy;
+	db->count++;
+}
+
+/*
+ * Remove a slot from the index. The following elements of its probe sequence
+ * are moved back so that no tombstone is needed.
+ */
+static void unindex_slot(kvomr_db_t* db, kv_slot_t* slot) {
+	size_t mask = db->capacity - 1;
+	size_t hole = slot - db->slots;
+	for (size_t i = (hole + 1) & mask; db->slots[i].element != NULL; i = (i + 1) & mask) {
+		size_t home = db->slots[i].hash & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) { // The hole is on its way
+			db->slots[hole] = db->slots[i];
+			hole = i;
 		}
-		arg->element = element;
-		return 1;
 	}
+	db->slots[hole].element = NULL;
+	db->count--;
+}
 
-	struct crawler_arg_s arg = {.key = k};
-	int rc = mr_crawl(heaplet, key_searcher, &arg);
-	if (rc) {
-		return arg.element;
+/*
+ * Size class of a deleted record.
+ */
+static size_t space_class(size_t space) {
+	size_t ret = 0;
+	while (ret + 1 < KV_CLASSES && ((size_t) 1 << (ret + 1)) <= space) {
+		ret++;
+	}
+	return ret;
+}
+
+/*
+ * Keep a deleted record to be reused.
+ */
+static void push_free(kvomr_db_t* db, char* record) {
+	kv_free_list_t* list = &db->free_lists[space_class(record_space(record))];
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+		list->records = realloc(list->records, sizeof(char*) * list->capacity);
+	}
+	list->records[list->count] = record;
+	list->count++;
+}
+
+/*
+ * Take a deleted record with at least space bytes for its key and value.
+ * Return NULL if there is none.
+ */
+static char* pop_free(kvomr_db_t* db, size_t space) {
+	size_t class = space_class(space);
+	if (((size_t) 1 << class) < space) { // Records of that class might be too small
+		class++;
+	}
+	for (; class<KV_CLASSES; class++) {
+		kv_free_list_t* list = &db->free_lists[class];
+		if (list->count > 0) {
+			list->count--;
+			return list->records[list->count];
+		}
 	}
 	return NULL;
 }
 
 /*
- * Count the number of elements in the db.
+ * Index all the elements of the messy room of a data base in a single crawl.
+ * New records are packed in the last heaplets made.
  */
-static size_t elems_in_db(mr_heaplet_t* heaplet) {
-	int elem_counter(uint64_t size, char* data, void* extra_args) {
-		if (size == sizeof(kv_t)) {
-			kv_t* element = (kv_t*) data;
-			if (strcmp(element->key, "")) {
-				size_t* arg = extra_args;
-				*arg = *arg + 1;
+static void index_room(kvomr_db_t* db) {
+	mr_set_placement(db->heaplet, MR_PLACE_LAST_WITH_ROOM); // Keeps heaplets full as records are small
+	int elem_indexer(uint64_t size, char* data, void* extra_args) {
+		(void) extra_args;
+		bool legacy = size == sizeof(kv_t);
+		if (!legacy && !is_record(size, data)) {
+			return 0; // Not an element
+		}
+		char* k = element_key(data, legacy);
+		if (!strcmp(k, "")) {
+			if (!legacy) { // Deleted kv_t are not reused as they could not hold every value
+				push_free(db, data);
+			}
+		} else {
+			uint64_t hash = hash_key(k);
+			if (db->capacity == 0 || find_slot(db, k, hash)->element == NULL) { // The first copy of a key wins
+				index_element(db, data, legacy, hash);
 			}
 		}
 		return 0;
 	}
+	mr_crawl(db->heaplet, elem_indexer, NULL);
+}
 
-	size_t ret = 0;
-	mr_crawl(heaplet, elem_counter, &ret);
-	return ret;
+/*
+ * Open a data base stored in a messy room.
+ */
+kvomr_db_t* kvomr_open(mr_heaplet_t* heaplet) {
+	kvomr_db_t* db = calloc(1, sizeof(kvomr_db_t));
+	db->heaplet = heaplet;
+	index_room(db);
+	return db;
+}
+
+/*
+ * Free the index of a data base, but not the structure itself.
+ */
+static void free_index(kvomr_db_t* db) {
+	free(db->slots);
+	db->slots = NULL;
+	db->capacity = 0;
+	db->count = 0;
+	for (size_t i=0; i<KV_CLASSES; i++) {
+		free(db->free_lists[i].records);
+		db->free_lists[i].records = NULL;
+		db->free_lists[i].count = 0;
+		db->free_lists[i].capacity = 0;
+	}
+}
+
+/*
+ * Free the index of a data base. The messy room is left untouched.
+ */
+void kvomr_close(kvomr_db_t* db) {
+	free_index(db);
+	free(db);
 }
 
 /*
- * Write or overwrite an element to the kv store.
+ * Search for the slot of the element with the corresponding key.
+ * Assumes that the key is not too big.
+ * Returns it if found and NULL if not.
+ */
+static kv_slot_t* get_from_key(const kvomr_db_t* db, const char* k) {
+	if (db->count == 0) {
+		return NULL;
+	}
+	kv_slot_t* slot = find_slot(db, k, hash_key(k));
+	return slot->element == NULL ? NULL : slot;
+}
+
+/*
+ * Remove an element from the index and mark it deleted.
+ */
+static void delete_slot(kvomr_db_t* db, kv_slot_t* slot) {
+	char* element = slot->element;
+	bool legacy = slot->legacy;
+	unindex_slot(db, slot);
+	element_key(element, legacy)[0] = 0;
+	if (!legacy) {
+		push_free(db, element);
+	}
+}
+
+/*
+ * Write or overwrite an element to the kv store. A value is overwritten in
+ * place if it fits, otherwise the element is moved to a new record.
  * Assumes that both the key and the value are of the
  * right size.
  */
-void kvomr_write(mr_heaplet_t* heaplet, const char* k, const char* v) {
-	kv_t* element = get_from_key(heaplet, k);
-	if (element == NULL) { // Try to reclaim a deleted element
-		element = get_from_key(heaplet, "");
-	}
-	if (element == NULL) {
-		kv_t* emptied_element = get_from_key(heaplet, "");
-		if (emptied_element == NULL) {
-			kv_t new_element;
-			memset(new_element.key, 0, K_SIZE+1);
-			memset(new_element.value, 0, V_SIZE+1);
-			strcpy(new_element.key, k);
-			strcpy(new_element.value, v);
-			mr_add_data(heaplet, sizeof(kv_t), &new_element);
-		} else {
+void kvomr_write(kvomr_db_t* db, const char* k, const char* v) {
+	size_t v_size = strlen(v);
+	kv_slot_t* slot = get_from_key(db, k);
+	if (slot != NULL) {
+		if (v_size <= value_capacity(slot->element, slot->legacy)) {
+			memcpy(element_value(slot->element, slot->legacy), v, v_size + 1);
+			return;
 		}
-		return;
+		delete_slot(db, slot);
 	}
-	memset(element->key, 0, K_SIZE+1);
-	strcpy(element->key, k);
-	memset(element->value, 0, V_SIZE+1);
-	strcpy(element->value, v);
+	size_t space = strlen(k) + 1 + v_size + 1;
+	char* record = pop_free(db, space);
+	if (record != NULL) { // Reclaim a deleted record
+		fill_record(record, record_space(record), k, v);
+	} else {
+		size_t size = (KV_HEADER_SIZE + space + KV_ALIGN - 1) / KV_ALIGN * KV_ALIGN;
+		if (size == sizeof(kv_t)) {
+			size += KV_ALIGN;
+		}
+		record = mr_reserve(db->heaplet, size, NULL); // Built in place, its padding is already 0
+		fill_record(record, size - KV_HEADER_SIZE, k, v);
+	}
+	index_element(db, record, false, hash_key(k));
 }
 
 /*
  * Find a value from a key. Return NULL if not found.
  */
-char* kvomr_read(mr_heaplet_t* heaplet, const char* k) {
-	kv_t* element = get_from_key(heaplet, k);
-	if (element == NULL) {
+char* kvomr_read(kvomr_db_t* db, const char* k) {
+	kv_slot_t* slot = get_from_key(db, k);
+	if (slot == NULL) {
 		return NULL;
 	}
-	return element->value;
+	return element_value(slot->element, slot->legacy);
 }
 
 /*
  * Delete the key from an element from the database. Return true if the element
  * is found and false if it is not.
  */
-bool kvomr_delete(mr_heaplet_t* heaplet, const char* k) {
-	kv_t* element = get_from_key(heaplet, k);
-	if (element == NULL) {
+bool kvomr_delete(kvomr_db_t* db, const char* k) {
+	kv_slot_t* slot = get_from_key(db, k);
+	if (slot == NULL) {
 		return false;
 	}
-	strcpy(element->key, "");
+	delete_slot(db, slot);
 	return true;
 }
 
 /*
  * Return a NULL terminated list of all the element in the db.
  */
-char** kvomr_list(mr_heaplet_t* heaplet) {
-	struct lister_arg_s {
-		char** list;
-		size_t index;
-	};
-
-	int elem_lister(uint64_t size, char* data, void* extra_args) {
-		if (size == sizeof(kv_t)) {
-			kv_t* element = (kv_t*) data;
-			if (strcmp(element->key, "")) {
-				struct lister_arg_s* arg = extra_args;
-				arg->list[arg->index] = element->key;
-				arg->index++;
-			}
+char** kvomr_list(kvomr_db_t* db) {
+	char** ret = malloc(sizeof(char*) * (db->count + 1));
+	size_t index = 0;
+	for (size_t i=0; i<db->capacity; i++) {
+		if (db->slots[i].element != NULL) {
+			ret[index] = element_key(db->slots[i].element, db->slots[i].legacy);
+			index++;
 		}
-		return 0;
 	}
-
-	size_t n_elems = elems_in_db(heaplet);
-	char** ret = malloc(sizeof(char*) * (n_elems + 1));
-	for (size_t i=0; i<=n_elems; i++) {
-		ret[i] = NULL;
-	}
-
-	struct lister_arg_s arg = {.list = ret, .index = 0};
-	mr_crawl(heaplet, elem_lister, &arg);
+	ret[index] = NULL;
 	return ret;
 }
 
+/*
+ * Copy the elements of a data base into a new, dense messy room, leaving out
+ * deleted records and the copies of a key which are not indexed. The data
+ * base is then over the new room, which is returned. The old one is left
+ * untouched.
+ */
+mr_heaplet_t* kvomr_compact(kvomr_db_t* db) {
+	bool is_live(uint64_t size, char* data, void* extra_args) {
+		(void) extra_args;
+		bool legacy = size == sizeof(kv_t);
+		if (!legacy && !is_record(size, data)) {
+			return true; // Not an element, kept as is
+		}
+		kv_slot_t* slot = get_from_key(db, element_key(data, legacy));
+		return slot != NULL && slot->element == data;
+	}
+	db->heaplet = mr_compact(db->heaplet, is_live, NULL);
+	free_index(db);
+	index_room(db);
+	return db->heaplet;
+}
@@ -5,12 +5,17 @@
 #include <stdbool.h>
 
 #define K_SIZE 255
-#define V_SIZE 255
+#define V_SIZE 4095
 
-void kvomr_write(mr_heaplet_t* heaplet, const char* k, const char* v);
-char* kvomr_read(mr_heaplet_t* heaplet, const char* k);
-bool kvomr_delete(mr_heaplet_t* heaplet, const char* k);
-char** kvomr_list(mr_heaplet_t* heaplet);
+typedef struct kvomr_db_s kvomr_db_t;
+
+kvomr_db_t* kvomr_open(mr_heaplet_t* heaplet);
+void kvomr_close(kvomr_db_t* db);
+void kvomr_write(kvomr_db_t* db, const char* k, const char* v);
+char* kvomr_read(kvomr_db_t* db, const char* k);
+bool kvomr_delete(kvomr_db_t* db, const char* k);
+char** kvomr_list(kvomr_db_t* db);
+mr_heaplet_t* kvomr_compact(kvomr_db_t* db);
 
 #endif
 
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE // For accept4
+#include "kv-server.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+/*
+ * Clients send command lines, ended by a newline, over a Unix domain socket.
+ * The server answers each of them, in order, with:
+ *   its exit code and the size of its output, in decimal, separated by a
+ *   space and ended by a newline
+ *   its output
+ * Clients can send several commands without waiting for their answers.
+ */
+#define MAX_LINE 8192 // Longer than any command
+#define MAX_HEADER 32
+#define MAX_EVENTS 64
+
+typedef struct {
+	int fd;
+	size_t index; // In the list of connections
+	char in[MAX_LINE];
+	size_t in_size;
+	char* out;
+	size_t out_size;
+	size_t out_sent;
+	size_t out_capacity;
+	uint32_t events; // Events the connection is waiting for
+} connection_t;
+
+struct kvomr_client_s {
+	int fd;
+	char buffer[MAX_LINE];
+	size_t begin;
+	size_t end;
+};
+
+/*
+ * Fill the address of a socket. Return false if the path is too long.
+ */
+static bool socket_address(const char* path, struct sockaddr_un* addr) {
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Error, socket path %s is too long\n", path);
+		return false;
+	}
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+/*
+ * Append bytes to the output of a connection.
+ */
+static void push_output(connection_t* connection, const char* data, size_t size) {
+	if (connection->out_size + size > connection->out_capacity) {
+		while (connection->out_size + size > connection->out_capacity) {
+			connection->out_capacity = connection->out_capacity == 0 ? MAX_LINE : connection->out_capacity * 2;
+		}
+		connection->out = realloc(connection->out, connection->out_capacity);
+	}
+	memcpy(connection->out + connection->out_size, data, size);
+	connection->out_size += size;
+}
+
+/*
+ * Run the complete command lines received on a connection and queue their
+ * answers.
+ */
+static void run_lines(connection_t* connection, kvomr_handler_t handler, void* extra_args) {
+	size_t begin = 0;
+	char* newline;
+	while ((newline = memchr(connection->in + begin, '\n', connection->in_size - begin)) != NULL) {
+		*newline = 0;
+		char* output;
+		size_t output_size;
+		FILE* out = open_memstream(&output, &output_size);
+		int rc = handler(connection->in + begin, out, extra_args);
+		fclose(out);
+		char header[MAX_HEADER];
+		int header_size = snprintf(header, MAX_HEADER, "%i %zu\n", rc, output_size);
+		push_output(connection, header, header_size);
+		push_output(connection, output, output_size);
+		free(output);
+		begin = newline + 1 - connection->in;
+	}
+	memmove(connection->in, connection->in + begin, connection->in_size - begin);
+	connection->in_size -= begin;
+}
+
+/*
+ * Read the commands received on a connection and run them, queueing their
+ * answers. New commands are only read once the answers to the previous ones
+ * are sent, so that a client not reading them can not make the server buffer
+ * without limit. Return false if the connection is to be closed.
+ */
+static bool receive_lines(connection_t* connection, kvomr_handler_t handler, void* extra_args) {
+	if (connection->out_sent < connection->out_size) {
+		return true;
+	}
+	if (connection->in_size == MAX_LINE) { // No command is that long
+		return false;
+	}
+	ssize_t received = read(connection->fd, connection->in + connection->in_size, MAX_LINE - connection->in_size);
+	if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		return false;
+	}
+	if (received > 0) {
+		connection->in_size += received;
+		run_lines(connection, handler, extra_args);
+	}
+	return true;
+}
+
+/*
+ * Send the queued answers of a connection as far as it can be without
+ * blocking, and wait for more commands once they are all sent. Return false
+ * if the connection is to be closed.
+ */
+static bool send_answers(int epoll_fd, connection_t* connection) {
+	while (connection->out_sent < connection->out_size) {
+		ssize_t sent = send(connection->fd, connection->out + connection->out_sent, connection->out_size - connection->out_sent, MSG_NOSIGNAL);
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (sent < 0 && errno != EINTR) {
+			return false;
+		}
+		if (sent > 0) {
+			connection->out_sent += sent;
+		}
+	}
+	uint32_t events = EPOLLIN;
+	if (connection->out_sent < connection->out_size) {
+		events = EPOLLOUT;
+	} else {
+		connection->out_size = 0;
+		connection->out_sent = 0;
+	}
+	if (events != connection->events) {
+		struct epoll_event event = {.events = events, .data.ptr = connection};
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event)) {
+			return false;
+		}
+		connection->events = events;
+	}
+	return true;
+}
+
+/*
+ * Serve a data base over a Unix domain socket until SIGINT or SIGTERM is
+ * received. Command lines are run by handler. The commands received at once
+ * are run, then syncer is called once for all of them before their answers
+ * are sent, so that what is acknowledged is durable. The server stops if it
+ * fails. saver is called every save_interval seconds, if it is not 0, and
+ * before returning. A stale socket left by a previous server is replaced.
+ * Return false on error.
+ */
+bool kvomr_server_run(const char* path, kvomr_handler_t handler, kvomr_syncer_t syncer, kvomr_saver_t saver, unsigned int save_interval, void* extra_args) {
+	struct sockaddr_un addr;
+	if (!socket_address(path, &addr)) {
+		return false;
+	}
+	kvomr_client_t* other = kvomr_server_connect(path);
+	if (other != NULL) {
+		kvomr_server_disconnect(other);
+		fprintf(stderr, "Error, %s is already served\n", path);
+		return false;
+	}
+	unlink(path);
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(listen_fd, SOMAXCONN)) {
+		fprintf(stderr, "Error, unable to listen on %s\n", path);
+		if (listen_fd >= 0) {
+			close(listen_fd);
+		}
+		return false;
+	}
+
+	// Signals and the save schedule are waited for as the connections are
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+	int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct itimerspec schedule = {
+		.it_interval = {.tv_sec = save_interval},
+		.it_value = {.tv_sec = save_interval},
+	};
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event = {.events = EPOLLIN};
+	bool ok = signal_fd >= 0 && timer_fd >= 0 && epoll_fd >= 0 && !timerfd_settime(timer_fd, 0, &schedule, NULL);
+	event.data.ptr = &listen_fd;
+	ok = ok && !epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+	event.data.ptr = &signal_fd;
+	ok = ok && !epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+	event.data.ptr = &timer_fd;
+	ok = ok && !epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+	if (!ok) {
+		fprintf(stderr, "Error, unable to wait for events\n");
+	}
+
+	connection_t** connections = NULL;
+	size_t number_of_connections = 0;
+	size_t connections_capacity = 0;
+	void close_connection(connection_t* connection) {
+		close(connection->fd);
+		number_of_connections--;
+		connections[connection->index] = connections[number_of_connections];
+		connections[connection->index]->index = connection->index;
+		free(connection->out);
+		free(connection);
+	}
+
+	bool running = ok;
+	while (running) {
+		struct epoll_event events[MAX_EVENTS];
+		connection_t* answering[MAX_EVENTS]; // Connections with answers to send
+		int number_answering = 0;
+		int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "Error, unable to wait for events\n");
+			ok = false;
+			break;
+		}
+		for (int i=0; i<n; i++) {
+			if (events[i].data.ptr == &listen_fd) { // New clients
+				int fd;
+				while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					connection_t* connection = calloc(1, sizeof(connection_t));
+					connection->fd = fd;
+					connection->events = EPOLLIN;
+					struct epoll_event new_event = {.events = EPOLLIN, .data.ptr = connection};
+					if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &new_event)) {
+						close(fd);
+						free(connection);
+						continue;
+					}
+					if (number_of_connections == connections_capacity) {
+						connections_capacity = connections_capacity == 0 ? 16 : connections_capacity * 2;
+						connections = realloc(connections, sizeof(connection_t*) * connections_capacity);
+					}
+					connection->index = number_of_connections;
+					connections[number_of_connections] = connection;
+					number_of_connections++;
+				}
+			} else if (events[i].data.ptr == &signal_fd) { // Time to stop
+				struct signalfd_siginfo info;
+				if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+					running = false;
+				}
+			} else if (events[i].data.ptr == &timer_fd) {
+				uint64_t expirations;
+				if (read(timer_fd, &expirations, sizeof(uint64_t)) == sizeof(uint64_t)) {
+					saver(extra_args);
+				}
+			} else {
+				connection_t* connection = events[i].data.ptr;
+				if (receive_lines(connection, handler, extra_args)) {
+					answering[number_answering] = connection;
+					number_answering++;
+				} else {
+					close_connection(connection);
+				}
+			}
+		}
+		if (number_answering > 0 && !syncer(extra_args)) {
+			ok = false;
+			break;
+		}
+		for (int i=0; i<number_answering; i++) {
+			if (!send_answers(epoll_fd, answering[i])) {
+				close_connection(answering[i]);
+			}
+		}
+	}
+
+	while (number_of_connections > 0) {
+		close_connection(connections[0]);
+	}
+	free(connections);
+	saver(extra_args);
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+	}
+	if (timer_fd >= 0) {
+		close(timer_fd);
+	}
+	if (signal_fd >= 0) {
+		close(signal_fd);
+	}
+	close(listen_fd);
+	unlink(path);
+	sigprocmask(SIG_UNBLOCK, &signals, NULL);
+	return ok;
+}
+
+/*
+ * Connect to the server of a data base. Return NULL if there is none.
+ */
+kvomr_client_t* kvomr_server_connect(const char* path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path) || !socket_address(path, &addr)) {
+		return NULL;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		close(fd);
+		return NULL;
+	}
+	kvomr_client_t* client = malloc(sizeof(kvomr_client_t));
+	client->fd = fd;
+	client->begin = 0;
+	client->end = 0;
+	return client;
+}
+
+/*
+ * Read more of the answers from the server. Return false if there is no more.
+ */
+static bool receive(kvomr_client_t* client) {
+	memmove(client->buffer, client->buffer + client->begin, client->end - client->begin);
+	client->end -= client->begin;
+	client->begin = 0;
+	while (true) {
+		ssize_t received = read(client->fd, client->buffer + client->end, MAX_LINE - client->end);
+		if (received > 0) {
+			client->end += received;
+			return true;
+		}
+		if (received == 0 || errno != EINTR) {
+			return false;
+		}
+	}
+}
+
+/*
+ * Send a command line, without its newline, to the server. Its answer is
+ * read with kvomr_server_receive, so that several commands can be sent
+ * before. Return false if the connection is lost.
+ */
+bool kvomr_server_send(kvomr_client_t* client, const char* line) {
+	size_t size = strlen(line);
+	char* request = malloc(size + 1);
+	memcpy(request, line, size);
+	request[size] = '\n';
+	size++;
+	for (size_t sent_size = 0; sent_size < size;) {
+		ssize_t sent = send(client->fd, request + sent_size, size - sent_size, MSG_NOSIGNAL);
+		if (sent < 0 && errno != EINTR) {
+			free(request);
+			fprintf(stderr, "Error, connection to the server lost\n");
+			return false;
+		}
+		if (sent > 0) {
+			sent_size += sent;
+		}
+	}
+	free(request);
+	return true;
+}
+
+/*
+ * Read the answer to the oldest command sent and write its output to out, or
+ * to err if it failed. Return its exit code, or -1 if the connection is lost.
+ */
+int kvomr_server_receive(kvomr_client_t* client, FILE* out, FILE* err) {
+	char* newline;
+	while ((newline = memchr(client->buffer + client->begin, '\n', client->end - client->begin)) == NULL) {
+		if (client->end - client->begin >= MAX_HEADER || !receive(client)) {
+			fprintf(stderr, "Error, connection to the server lost\n");
+			return -1;
+		}
+	}
+	*newline = 0;
+	int rc;
+	size_t output_size;
+	if (sscanf(client->buffer + client->begin, "%i %zu", &rc, &output_size) != 2) {
+		fprintf(stderr, "Error, invalid answer from the server\n");
+		return -1;
+	}
+	client->begin = newline + 1 - client->buffer;
+	FILE* dest = rc == 0 ? out : err;
+	while (output_size > 0) {
+		if (client->begin == client->end && !receive(client)) {
+			fprintf(stderr, "Error, connection to the server lost\n");
+			return -1;
+		}
+		size_t chunk = client->end - client->begin;
+		chunk = chunk < output_size ? chunk : output_size;
+		fwrite(client->buffer + client->begin, 1, chunk, dest);
+		client->begin += chunk;
+		output_size -= chunk;
+	}
+	return rc;
+}
+
+/*
+ * Run a command line, without its newline, on the server. Return its exit
+ * code, or -1 if the connection is lost.
+ */
+int kvomr_server_request(kvomr_client_t* client, const char* line, FILE* out, FILE* err) {
+	if (!kvomr_server_send(client, line)) {
+		return -1;
+	}
+	return kvomr_server_receive(client, out, err);
+}
+
+/*
+ * Close a connection to a server.
+ */
+void kvomr_server_disconnect(kvomr_client_t* client) {
+	close(client->fd);
+	free(client);
+}
+
@@ -0,0 +1,32 @@
+#ifndef KV_SERVER
+#define KV_SERVER
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct kvomr_client_s kvomr_client_t;
+
+/*
+ * Run a command line, writing what it outputs to out. Return its exit code.
+ */
+typedef int (*kvomr_handler_t)(char* line, FILE* out, void* extra_args);
+
+/*
+ * Make the changes made by the commands run durable. Return false on error.
+ */
+typedef bool (*kvomr_syncer_t)(void* extra_args);
+
+/*
+ * Save the data base served.
+ */
+typedef void (*kvomr_saver_t)(void* extra_args);
+
+bool kvomr_server_run(const char* path, kvomr_handler_t handler, kvomr_syncer_t syncer, kvomr_saver_t saver, unsigned int save_interval, void* extra_args);
+kvomr_client_t* kvomr_server_connect(const char* path);
+bool kvomr_server_send(kvomr_client_t* client, const char* line);
+int kvomr_server_receive(kvomr_client_t* client, FILE* out, FILE* err);
+int kvomr_server_request(kvomr_client_t* client, const char* line, FILE* out, FILE* err);
+void kvomr_server_disconnect(kvomr_client_t* client);
+
+#endif
+
@@ -1,6 +1,9 @@
 #include "kv-over-messy-room.h"
+#include "kv-log.h"
+#include "kv-server.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 
 /*
@@ -50,22 +53,126 @@ static FILE* open_db(const char* mode) {
 }
 
 /*
- * Open the data base.
+ * Get the filename of the log of the data base, next to its messy-room file.
+ */
+static char* get_log_path(void) {
+	char* path = get_db_path();
+	char* ret = malloc(strlen(path) + strlen(".log") + 1);
+	strcpy(ret, path);
+	strcat(ret, ".log");
+	free(path);
+	return ret;
+}
+
+/*
+ * Open the data base. Its file is mapped in memory rather than read, only
+ * its compressed heaplets, if it has been written with --compress, are
+ * copied. The mapping is private as the changes
+ * in the log are replayed over it, they only reach the file with a checkpoint.
  */
 static mr_heaplet_t* read_db(void) {
-	FILE* f = open_db("r");
-	mr_heaplet_t* ret = mr_read_from_file(f);
-	fclose(f);
+	fclose(open_db("r")); // Ensure that the file exists
+	char* path = get_db_path();
+	mr_heaplet_t* ret = mr_open_mapped(path, MR_MAP_PRIVATE);
+	if (ret == NULL) {
+		fprintf(stderr, "Error, unable to read %s\n", path);
+		exit(2);
+	}
+	free(path);
 	return ret;
 }
 
 /*
- * Save the data base.
+ * Save the data base. As the old file might still be mapped, the data base is
+ * written in a new file which then atomically replaces the old one. The file
+ * is compressed if compress is set: it is several times smaller, as records
+ * are mostly padding, but then all of it has to be decompressed each time
+ * the data base is opened instead of being used straight from the mapping.
  */
-static void save_db(mr_heaplet_t* heaplet) {
-	FILE* f = open_db("w");
-	mr_write_to_file(heaplet, f);
+static void save_db(mr_heaplet_t* heaplet, bool compress) {
+	char* path = get_db_path();
+	char* tmp_path = malloc(strlen(path) + strlen(".tmp") + 1);
+	strcpy(tmp_path, path);
+	strcat(tmp_path, ".tmp");
+	FILE* f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Error, unable to open %s\n", tmp_path);
+		exit(2);
+	}
+	mr_write_to_file_flags(heaplet, f, compress ? MR_WRITE_COMPRESS : 0);
+	if (fflush(f) || fsync(fileno(f))) {
+		fprintf(stderr, "Error, unable to write %s\n", tmp_path);
+		exit(2);
+	}
 	fclose(f);
+	if (rename(tmp_path, path)) {
+		fprintf(stderr, "Error, unable to replace %s\n", path);
+		exit(2);
+	}
+	free(tmp_path);
+	free(path);
+}
+
+/*
+ * Open the log of the data base to write changes to it. It is locked before
+ * the data base is read, so that no other writer changes the data base file
+ * or its log until it is closed.
+ */
+static kvomr_log_t* open_log(unsigned int sync_every) {
+	char* log_path = get_log_path();
+	kvomr_log_t* ret = kvomr_log_open(log_path, sync_every);
+	free(log_path);
+	if (ret == NULL) {
+		exit(2);
+	}
+	return ret;
+}
+
+/*
+ * Index the data base and bring it up to date with its log, either the one
+ * opened to write new changes or, if log is NULL, the log file.
+ */
+static kvomr_db_t* open_index(mr_heaplet_t* heaplet, kvomr_log_t* log) {
+	kvomr_db_t* db = kvomr_open(heaplet);
+	if (log == NULL) {
+		char* log_path = get_log_path();
+		kvomr_log_replay(log_path, db);
+		free(log_path);
+	} else if (!kvomr_log_load(log, db)) {
+		exit(2);
+	}
+	return db;
+}
+
+/*
+ * Get the filename of the socket of the data base server. It is either
+ * $KVOMR_SOCKET, or the messy-room file name followed by .sock
+ */
+static char* get_socket_path(void) {
+	if (getenv("KVOMR_SOCKET") != NULL) {
+		return strdup(getenv("KVOMR_SOCKET"));
+	}
+	char* path = get_db_path();
+	char* ret = malloc(strlen(path) + strlen(".sock") + 1);
+	strcpy(ret, path);
+	strcat(ret, ".sock");
+	free(path);
+	return ret;
+}
+
+/*
+ * Write the data base, compacted and compressed if compress is set, to its
+ * file and empty the log. The data base is then over the compacted room.
+ */
+static int checkpoint(kvomr_db_t* db, mr_heaplet_t** heaplet, kvomr_log_t* log, bool compress) {
+	mr_heaplet_t* compacted = kvomr_compact(db);
+	mr_free(*heaplet);
+	*heaplet = compacted;
+	save_db(*heaplet, compress);
+	if (!kvomr_log_truncate(log)) { // Replaying it again over the new file would be harmless
+		return 2;
+	}
+	return 0;
 }
 
 static void help(const char* prg_name) {
@@ -77,24 +184,300 @@ static void help(const char* prg_name) {
 	printf("  %s <k> <v>      Store the message <v> at the key <k>\n", prg_name);
 	printf("  %s <k>          Show the message at the key <k>\n", prg_name);
 	printf("  %s --del <k>    Delete the value at the key <k>\n", prg_name);
+	printf("  %s --checkpoint [--compress]\n", prg_name);
+	printf("                  Write the changes in the log to the data base file,\n");
+	printf("                  compressed: smaller, but slower to open\n");
+	printf("  %s --batch [N]  Run the commands read from stdin, one per line:\n", prg_name);
+	printf("                      get <k>, put <k> <v>, del <k> or list\n");
+	printf("                  The log is synced every N writes and at the end\n");
+	printf("  %s --serve <socket> [S]\n", prg_name);
+	printf("                  Keep the data base in memory and serve it on a Unix\n");
+	printf("                  socket, with a checkpoint every S seconds (60 by default)\n");
 	printf("\n");
+	printf("When a server listens on $KVOMR_SOCKET, or on the data base file name\n");
+	printf("followed by .sock, the commands are sent to it.\n");
+	printf("\n");
+}
+
+/*
+ * Check that a key can be stored. Return 0 if it can or the exit code of the
+ * error.
+ */
+static int check_key(const char* k, FILE* err) {
+	if (strlen(k) > K_SIZE) {
+		fprintf(err, "Error: key in larger than %i bytes.\n", K_SIZE);
+		return 4;
+	}
+	if (strlen(k) == 0) {
+		fprintf(err, "Error: empty key.\n");
+		return 8;
+	}
+	return 0;
+}
+
+/*
+ * Check that a value can be stored. Return 0 if it can or the exit code of
+ * the error.
+ */
+static int check_value(const char* v, FILE* err) {
+	if (strlen(v) > V_SIZE) {
+		fprintf(err, "Error: value in larger than %i bytes.\n", V_SIZE);
+		return 4;
+	}
+	return 0;
+}
+
+/*
+ * Print all the keys of the data base.
+ */
+static void list_keys(kvomr_db_t* db, FILE* out) {
+	char** key_list = kvomr_list(db);
+	size_t i = 0;
+	while(key_list[i] != NULL) {
+		fprintf(out, "%s\n", key_list[i]);
+		i++;
+	}
+	free(key_list);
+}
+
+/*
+ * Print the value at a key.
+ */
+static int get_value(kvomr_db_t* db, const char* k, FILE* out, FILE* err) {
+	int rc = check_key(k, err);
+	if (rc != 0) {
+		return rc;
+	}
+	char* ret = kvomr_read(db, k);
+	if (ret == NULL) {
+		fprintf(out, "No value indexed with the key \"%s\".\n", k);
+	} else {
+		fprintf(out, "%s\n", ret);
+	}
+	return 0;
+}
+
+/*
+ * Store a value at a key and log it.
+ */
+static int put_value(kvomr_db_t* db, kvomr_log_t* log, const char* k, const char* v, FILE* out, FILE* err) {
+	int rc = check_key(k, err);
+	if (rc == 0) {
+		rc = check_value(v, err);
+	}
+	if (rc != 0) {
+		return rc;
+	}
+	char* already_there = kvomr_read(db, k);
+	kvomr_write(db, k, v);
+	if (!kvomr_log_put(log, k, v)) {
+		return 2;
+	}
+	if (already_there == NULL) {
+		fprintf(out, "Added value to key \"%s\".\n", k);
+	} else {
+		fprintf(out, "Overwrote value to key \"%s\".\n", k);
+	}
+	return 0;
+}
+
+/*
+ * Delete the value at a key and log it.
+ */
+static int delete_value(kvomr_db_t* db, kvomr_log_t* log, const char* k, FILE* out, FILE* err) {
+	int rc = check_key(k, err);
+	if (rc != 0) {
+		return rc;
+	}
+	if (kvomr_delete(db, k)) {
+		if (!kvomr_log_del(log, k)) {
+			return 2;
+		}
+		fprintf(out, "Successfully deleted element at key %s\n", k);
+	} else {
+		fprintf(out, "No value indexed with the key \"%s\".\n", k);
+	}
+	return 0;
+}
+
+/*
+ * Run a command line: "get <k>", "put <k> <v>", "del <k>" or "list". Keys end
+ * at the first space and values at the end of the line. Return its exit code.
+ */
+static int run_command(kvomr_db_t* db, kvomr_log_t* log, char* line, FILE* out, FILE* err) {
+	char* k = strchr(line, ' ');
+	char* v = NULL;
+	if (k != NULL) {
+		*k = 0;
+		k++;
+		v = strchr(k, ' ');
+		if (v != NULL) {
+			*v = 0;
+			v++;
+		}
+	}
+	if (!strcmp(line, "get") && k != NULL && v == NULL) {
+		return get_value(db, k, out, err);
+	} else if (!strcmp(line, "put") && k != NULL && v != NULL) {
+		return put_value(db, log, k, v, out, err);
+	} else if (!strcmp(line, "del") && k != NULL && v == NULL) {
+		return delete_value(db, log, k, out, err);
+	} else if (!strcmp(line, "list") && k == NULL) {
+		list_keys(db, out);
+		return 0;
+	}
+	fprintf(err, "Error: invalid command \"%s\".\n", line);
+	return 1;
+}
+
+/*
+ * Commands sent to the server before reading their answers in batch mode, and
+ * their total size. They must fit in the buffer of the socket, as the server
+ * does not read more of them before its answers are read.
+ */
+#define BATCH_IN_FLIGHT 64
+#define BATCH_IN_FLIGHT_BYTES (32 * 1024)
+
+/*
+ * Run the commands read from stdin, one per line, over a data base opened
+ * once, or on its server if client is not NULL. The log is synced every
+ * sync_every writes, or only at the end if it is 0. Return the exit code of
+ * the last error.
+ */
+static int batch(unsigned int sync_every, kvomr_client_t* client) {
+	mr_heaplet_t* heaplet = NULL;
+	kvomr_db_t* db = NULL;
+	kvomr_log_t* log = NULL;
+	if (client == NULL) {
+		log = open_log(sync_every);
+		heaplet = read_db();
+		db = open_index(heaplet, log);
+	}
+	int ret = 0;
+	unsigned int in_flight = 0; // Commands sent to the server whose answer is not read yet
+	size_t in_flight_sizes[BATCH_IN_FLIGHT]; // Of these commands, oldest first from in_flight_first
+	unsigned int in_flight_first = 0;
+	size_t in_flight_bytes = 0;
+	int receive(void) {
+		in_flight_bytes -= in_flight_sizes[in_flight_first];
+		in_flight_first = (in_flight_first + 1) % BATCH_IN_FLIGHT;
+		in_flight--;
+		int rc = kvomr_server_receive(client, stdout, stderr);
+		return rc < 0 ? 2 : rc;
+	}
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &capacity, stdin)) >= 0) {
+		if (length > 0 && line[length - 1] == '\n') {
+			line[length - 1] = 0;
+		}
+		int rc = 0;
+		size_t size = strlen(line) + 1;
+		while (client != NULL && rc != 2 && in_flight > 0 && (in_flight == BATCH_IN_FLIGHT || in_flight_bytes + size > BATCH_IN_FLIGHT_BYTES)) {
+			rc = receive(); // Make room for the command
+			if (rc != 0) {
+				ret = rc;
+			}
+		}
+		if (rc == 2) {
+			break;
+		} else if (client == NULL) {
+			rc = run_command(db, log, line, stdout, stderr);
+		} else if (!kvomr_server_send(client, line)) {
+			rc = 2;
+		} else {
+			in_flight_sizes[(in_flight_first + in_flight) % BATCH_IN_FLIGHT] = size;
+			in_flight_bytes += size;
+			in_flight++;
+		}
+		fflush(stdout);
+		if (rc != 0) {
+			ret = rc;
+		}
+		if (rc == 2) { // Unable to log, stop there
+			break;
+		}
+	}
+	while (client != NULL && in_flight > 0 && ret != 2) {
+		int rc = receive();
+		if (rc != 0) {
+			ret = rc;
+		}
+	}
+	fflush(stdout);
+	free(line);
+	if (client == NULL) {
+		kvomr_log_close(log);
+		kvomr_close(db);
+		mr_free(heaplet);
+	} else {
+		kvomr_server_disconnect(client);
+	}
+	return ret;
+}
+
+/*
+ * A data base kept in memory by a server.
+ */
+typedef struct {
+	mr_heaplet_t* heaplet;
+	kvomr_db_t* db;
+	kvomr_log_t* log;
+	unsigned int unsaved; // Writes since the last checkpoint
+} served_db_t;
+
+static int serve_command(char* line, FILE* out, void* extra_args) {
+	served_db_t* served = extra_args;
+	if (!strcmp(line, "checkpoint") || !strcmp(line, "checkpoint compress")) {
+		served->unsaved = 0;
+		return checkpoint(served->db, &served->heaplet, served->log, strcmp(line, "checkpoint") != 0);
+	}
+	bool write = !strncmp(line, "put ", 4) || !strncmp(line, "del ", 4);
+	int rc = run_command(served->db, served->log, line, out, out);
+	if (rc == 0 && write) {
+		served->unsaved++;
+	}
+	return rc;
+}
+
+static bool sync_served(void* extra_args) {
+	served_db_t* served = extra_args;
+	return kvomr_log_sync(served->log);
 }
 
-#define CHECK_KEY(k) \
-	if (strlen(k) > K_SIZE) { \
-		fprintf(stderr, "Error: key in larger than %i bytes.\n", K_SIZE); \
-		return 4; \
-	} \
-	if (strlen(k) == 0) { \
-		fprintf(stderr, "Error: empty key.\n"); \
-		return 8; \
+static void save_served(void* extra_args) {
+	served_db_t* served = extra_args;
+	if (served->unsaved > 0) {
+		served->unsaved = 0;
+		checkpoint(served->db, &served->heaplet, served->log, false);
 	}
+}
 
-#define CHECK_VALUE(v) \
-	if (strlen(v) > V_SIZE) { \
-		fprintf(stderr, "Error: value in larger than %i bytes.\n", V_SIZE); \
-		return 4; \
+/*
+ * Run a command on the server of the data base. Return its exit code.
+ */
+static int forward(kvomr_client_t* client, const char* command, const char* k, const char* v) {
+	if ((k != NULL && (strchr(k, ' ') != NULL || strchr(k, '\n') != NULL)) || (v != NULL && strchr(v, '\n') != NULL)) {
+		fprintf(stderr, "Error: keys with spaces and values with newlines can not be sent to the server.\n");
+		kvomr_server_disconnect(client);
+		return 1;
 	}
+	char* line = malloc(strlen(command) + (k == NULL ? 0 : strlen(k) + 1) + (v == NULL ? 0 : strlen(v) + 1) + 1);
+	strcpy(line, command);
+	if (k != NULL) {
+		strcat(line, " ");
+		strcat(line, k);
+	}
+	if (v != NULL) {
+		strcat(line, " ");
+		strcat(line, v);
+	}
+	int rc = kvomr_server_request(client, line, stdout, stderr);
+	free(line);
+	kvomr_server_disconnect(client);
+	return rc < 0 ? 2 : rc;
+}
 
 int main(int argc, char** argv) {
 	if (argc < 2) { // Getting help
@@ -107,18 +490,79 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+	if (!strcmp(argv[1], "--serve")) { // Keeping the data base in memory
+		if (argc != 3 && argc != 4) {
+			goto invalid_arg;
+		}
+		unsigned int save_interval = 60;
+		if (argc == 4) {
+			char* end;
+			save_interval = strtoul(argv[3], &end, 10);
+			if (*end != 0 || argv[3][0] == 0) {
+				goto invalid_arg;
+			}
+		}
+		served_db_t served = {.log = open_log(0), .unsaved = 0};
+		served.heaplet = read_db();
+		served.db = open_index(served.heaplet, served.log);
+		bool ok = kvomr_server_run(argv[2], serve_command, sync_served, save_served, save_interval, &served);
+		kvomr_log_close(served.log);
+		kvomr_close(served.db);
+		mr_free(served.heaplet);
+		return ok ? 0 : 2;
+	}
+
+	char* socket_path = get_socket_path();
+	kvomr_client_t* client = kvomr_server_connect(socket_path); // NULL if the data base is not served
+	free(socket_path);
+
 	if (!strcmp(argv[1], "--list")) { // Listing all saved keys
 		if (argc != 2) {
 			goto invalid_arg;
 		}
+		if (client != NULL) {
+			return forward(client, "list", NULL, NULL);
+		}
+		mr_heaplet_t* heaplet = read_db();
+		kvomr_db_t* db = open_index(heaplet, NULL);
+		list_keys(db, stdout);
+		kvomr_close(db);
+		mr_free(heaplet);
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "--batch")) { // Running commands from stdin
+		if (argc > 3) {
+			goto invalid_arg;
+		}
+		unsigned int sync_every = 0;
+		if (argc == 3) {
+			char* end;
+			sync_every = strtoul(argv[2], &end, 10);
+			if (*end != 0 || argv[2][0] == 0) {
+				goto invalid_arg;
+			}
+		}
+		return batch(sync_every, client);
+	}
+
+	if (!strcmp(argv[1], "--checkpoint")) { // Fold the log into the data base file
+		if (argc > 3 || (argc == 3 && strcmp(argv[2], "--compress"))) {
+			goto invalid_arg;
+		}
+		bool compress = argc == 3;
+		if (client != NULL) {
+			return forward(client, "checkpoint", compress ? "compress" : NULL, NULL);
+		}
+		kvomr_log_t* log = open_log(0);
 		mr_heaplet_t* heaplet = read_db();
-		char** key_list = kvomr_list(heaplet);
-		size_t i = 0;
-		while(key_list[i] != NULL) {
-			printf("%s\n", key_list[i]);
-			i++;
+		kvomr_db_t* db = open_index(heaplet, log);
+		int rc = checkpoint(db, &heaplet, log, compress);
+		if (rc != 0) {
+			return rc;
 		}
-		free(key_list);
+		kvomr_log_close(log);
+		kvomr_close(db);
 		mr_free(heaplet);
 		return 0;
 	}
@@ -127,45 +571,58 @@ int main(int argc, char** argv) {
 		if (argc != 3) {
 			goto invalid_arg;
 		}
-		CHECK_KEY(argv[2]);
-		mr_heaplet_t* heaplet = read_db();
-		if (kvomr_delete(heaplet, argv[2])) {
-			printf("Successfully deleted element at key %s\n", argv[2]);
-		} else {
-			printf("No value indexed with the key \"%s\".\n", argv[1]);
+		if (client != NULL) {
+			return forward(client, "del", argv[2], NULL);
+		}
+		int rc = check_key(argv[2], stderr);
+		if (rc != 0) {
+			return rc;
 		}
-		save_db(heaplet);
+		kvomr_log_t* log = open_log(0);
+		mr_heaplet_t* heaplet = read_db();
+		kvomr_db_t* db = open_index(heaplet, log);
+		rc = delete_value(db, log, argv[2], stdout, stderr);
+		kvomr_log_close(log);
+		kvomr_close(db);
 		mr_free(heaplet);
-		return 0;
+		return rc;
 	}
 
 	if (argc == 2) { // Reading an entry
-		CHECK_KEY(argv[1]);
-		mr_heaplet_t* heaplet = read_db();
-		char* ret = kvomr_read(heaplet, argv[1]);
-		if (ret == NULL) {
-			printf("No value indexed with the key \"%s\".\n", argv[1]);
-		} else {
-			printf("%s\n", ret);
+		if (client != NULL) {
+			return forward(client, "get", argv[1], NULL);
+		}
+		int rc = check_key(argv[1], stderr);
+		if (rc != 0) {
+			return rc;
 		}
+		mr_heaplet_t* heaplet = read_db();
+		kvomr_db_t* db = open_index(heaplet, NULL);
+		get_value(db, argv[1], stdout, stderr);
+		kvomr_close(db);
 		mr_free(heaplet);
 		return 0;
 	}
 
 	if (argc == 3) { // Writing an entry
-		CHECK_KEY(argv[1]);
-		CHECK_VALUE(argv[2]);
-		mr_heaplet_t* heaplet = read_db();
-		char* already_there = kvomr_read(heaplet, argv[1]);
-		kvomr_write(heaplet, argv[1], argv[2]);
-		if (already_there == NULL) {
-			printf("Added value to key \"%s\".\n", argv[1]);
-		} else {
-			printf("Overwrote value to key \"%s\".\n", argv[1]);
+		if (client != NULL) {
+			return forward(client, "put", argv[1], argv[2]);
 		}
-		save_db(heaplet);
+		int rc = check_key(argv[1], stderr);
+		if (rc == 0) {
+			rc = check_value(argv[2], stderr);
+		}
+		if (rc != 0) {
+			return rc;
+		}
+		kvomr_log_t* log = open_log(0);
+		mr_heaplet_t* heaplet = read_db();
+		kvomr_db_t* db = open_index(heaplet, log);
+		rc = put_value(db, log, argv[1], argv[2], stdout, stderr);
+		kvomr_log_close(log);
+		kvomr_close(db);
 		mr_free(heaplet);
-		return 0;
+		return rc;
 	}
 
 invalid_arg:
@@ -173,4 +630,3 @@ invalid_arg:
 	fprintf(stderr, "Use `%s --help` for more information.\n", argv[0]);
 	return 1;
 }
-
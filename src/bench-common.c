@@ -0,0 +1,151 @@
+#include "bench-common.h"
+#include "stdarg.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "sys/resource.h"
+#include "sys/wait.h"
+
+/*
+ * Benchmarks print a JSON array with an object per result. Each workload runs
+ * in its own process so that the peak RSS reported is its own.
+ */
+
+static bool first_result = true;
+
+/*
+ * Read the options shared by the benchmarks. Return false if they are
+ * invalid.
+ */
+bool bench_parse_options(int argc, char** argv, bench_options_t* options) {
+	options->max_items = 1000000;
+	options->max_bytes = 256 * 1024 * 1024;
+	options->only = NULL;
+	for (int i=1; i<argc; i++) {
+		if (i + 1 == argc) {
+			return false;
+		}
+		char* end;
+		if (!strcmp(argv[i], "--max-items")) {
+			options->max_items = strtoull(argv[i + 1], &end, 10);
+		} else if (!strcmp(argv[i], "--max-bytes")) {
+			options->max_bytes = strtoull(argv[i + 1], &end, 10);
+		} else if (!strcmp(argv[i], "--only")) {
+			options->only = argv[i + 1];
+			end = "";
+		} else {
+			return false;
+		}
+		if (*end != 0) {
+			return false;
+		}
+		i++;
+	}
+	return true;
+}
+
+/*
+ * Tell if a benchmark is to be run.
+ */
+bool bench_selected(const bench_options_t* options, const char* name) {
+	return options->only == NULL || !strcmp(options->only, name);
+}
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+uint64_t bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t ns) {
+	if (ns < 8) {
+		return ns;
+	}
+	int log = 63 - __builtin_clzll(ns);
+	return (log - 2) * 8 + ((ns >> (log - 3)) & 7);
+}
+
+static uint64_t bucket_value(size_t bucket) {
+	if (bucket < 8) {
+		return bucket;
+	}
+	return (uint64_t) (8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+/*
+ * Count the latency of an operation.
+ */
+void bench_record(bench_histogram_t* histogram, uint64_t ns) {
+	histogram->counts[bucket_of(ns)]++;
+	histogram->ops++;
+	if (ns > histogram->max) {
+		histogram->max = ns;
+	}
+}
+
+/*
+ * Latency under which percentile percents of the operations are.
+ */
+uint64_t bench_percentile(const bench_histogram_t* histogram, double percentile) {
+	uint64_t rank = histogram->ops * percentile / 100;
+	uint64_t seen = 0;
+	for (size_t i=0; i<BENCH_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen > rank) {
+			return bucket_value(i);
+		}
+	}
+	return histogram->max;
+}
+
+/*
+ * Print the result of a workload: the operations of histogram took ns
+ * nanoseconds in total and went through bytes bytes. The parameters of the
+ * workload are JSON members given as a printf format.
+ */
+void bench_report(const char* name, const bench_histogram_t* histogram, uint64_t ns, uint64_t bytes, const char* params_format, ...) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double seconds = ns / 1e9;
+	printf("%s  {\"benchmark\": \"%s\", ", first_result ? "" : ",\n", name);
+	va_list args;
+	va_start(args, params_format);
+	vprintf(params_format, args);
+	va_end(args);
+	printf(", \"ops\": %llu, \"seconds\": %.6f, \"ops_per_s\": %.1f, \"bytes_per_s\": %.1f", (unsigned long long) histogram->ops, seconds, histogram->ops / seconds, bytes / seconds);
+	printf(", \"ns_p50\": %llu, \"ns_p90\": %llu, \"ns_p99\": %llu, \"ns_max\": %llu", (unsigned long long) bench_percentile(histogram, 50), (unsigned long long) bench_percentile(histogram, 90), (unsigned long long) bench_percentile(histogram, 99), (unsigned long long) histogram->max);
+	printf(", \"peak_rss_kib\": %ld}", usage.ru_maxrss);
+	fflush(stdout);
+	exit(0); // The workload process is done
+}
+
+void bench_begin(void) {
+	printf("[\n");
+	fflush(stdout);
+}
+
+/*
+ * Run a workload in a new process. It reports its result with bench_report,
+ * or exits with a non-zero code if it has none.
+ */
+void bench_run(void (*workload)(void* arg), void* arg) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		workload(arg);
+		exit(1);
+	}
+	int status;
+	if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		first_result = false;
+	}
+}
+
+void bench_end(void) {
+	printf("\n]\n");
+}
+
@@ -0,0 +1,37 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
+
+/*
+ * Latencies are counted in buckets of logarithmic width, with 8 buckets per
+ * power of 2, so percentiles are exact to within 12.5%.
+ */
+#define BENCH_BUCKETS 496
+
+typedef struct {
+	uint64_t counts[BENCH_BUCKETS];
+	uint64_t ops;
+	uint64_t max;
+} bench_histogram_t;
+
+typedef struct {
+	size_t max_items;   // Biggest room or data base
+	size_t max_bytes;   // Biggest amount of data in a room
+	const char* only;   // Name of the only benchmark to run, or NULL
+} bench_options_t;
+
+bool bench_parse_options(int argc, char** argv, bench_options_t* options);
+bool bench_selected(const bench_options_t* options, const char* name);
+uint64_t bench_now(void);
+void bench_record(bench_histogram_t* histogram, uint64_t ns);
+uint64_t bench_percentile(const bench_histogram_t* histogram, double percentile);
+void bench_report(const char* name, const bench_histogram_t* histogram, uint64_t ns, uint64_t bytes, const char* params_format, ...) __attribute__ ((format (printf, 5, 6)));
+void bench_begin(void);
+void bench_run(void (*workload)(void* arg), void* arg);
+void bench_end(void);
+
+#endif
+
@@ -0,0 +1,187 @@
+#include "messy-room.h"
+#include "bench-common.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdio.h"
+
+/*
+ * Benchmarks of the messy room itself: insertions, crawls and round trips
+ * through arrays and files, for rooms of various sizes.
+ */
+
+static const size_t item_sizes[] = {8, 64, 512, 4096, 65536};
+#define NUMBER_OF_ITEM_SIZES (sizeof(item_sizes) / sizeof(size_t))
+
+#define MIN_ITEMS        1000
+#define MIN_REPETITIONS  3
+#define MAX_REPETITIONS  1000
+#define REPETITION_TIME  500000000 // Time a repeated operation is run for, in ns
+
+typedef struct {
+	size_t item_size;
+	size_t items;
+	bool follow; // Insert from the heaplet returned by the previous insertion
+	size_t max_serialized; // Rooms whose serialization would be bigger are not written
+} room_params_t;
+
+/*
+ * Make a room of items elements, timing each insertion if histogram is not
+ * NULL.
+ */
+static mr_heaplet_t* fill_room(const room_params_t* params, bench_histogram_t* histogram) {
+	mr_heaplet_t* first = mr_new();
+	mr_heaplet_t* heaplet = first;
+	char* item = calloc(params->item_size, 1);
+	for (size_t i=0; i<params->items; i++) {
+		memcpy(item, &i, params->item_size < sizeof(size_t) ? params->item_size : sizeof(size_t));
+		uint64_t start = histogram == NULL ? 0 : bench_now();
+		mr_heaplet_t* used = mr_add_data(params->follow ? heaplet : first, params->item_size, item);
+		if (histogram != NULL) {
+			bench_record(histogram, bench_now() - start);
+		}
+		heaplet = used;
+	}
+	free(item);
+	return first;
+}
+
+static void insert_workload(void* arg) {
+	const room_params_t* params = arg;
+	static bench_histogram_t histogram;
+	uint64_t start = bench_now();
+	fill_room(params, &histogram);
+	uint64_t ns = bench_now() - start;
+	bench_report("insert", &histogram, ns, params->items * params->item_size, "\"item_size\": %zu, \"items\": %zu, \"pattern\": \"%s\"", params->item_size, params->items, params->follow ? "follow" : "same");
+}
+
+static void bulk_insert_workload(void* arg) {
+	const room_params_t* params = arg;
+	static bench_histogram_t histogram;
+	char* items = calloc(params->items, params->item_size);
+	for (size_t i=0; i<params->items; i++) {
+		memcpy(items + i * params->item_size, &i, params->item_size < sizeof(size_t) ? params->item_size : sizeof(size_t));
+	}
+	mr_heaplet_t* heaplet = mr_new();
+	uint64_t start = bench_now();
+	mr_add_bulk(heaplet, params->item_size, items, params->items, NULL, 0);
+	uint64_t ns = bench_now() - start;
+	bench_record(&histogram, ns);
+	bench_report("insert_bulk", &histogram, ns, params->items * params->item_size, "\"item_size\": %zu, \"items\": %zu", params->item_size, params->items);
+	mr_free(heaplet);
+	free(items);
+}
+
+/*
+ * Repeat an operation on a room until it has run long enough and report it.
+ */
+static void repeat(const char* name, const room_params_t* params, void (*operation)(mr_heaplet_t* heaplet), uint64_t bytes_per_op, bool serialize) {
+	mr_heaplet_t* heaplet = fill_room(params, NULL);
+	if (serialize && mr_write_to_array(heaplet, NULL) > params->max_serialized) {
+		exit(1);
+	}
+	static bench_histogram_t histogram;
+	uint64_t total = 0;
+	while (histogram.ops < MAX_REPETITIONS && (histogram.ops < MIN_REPETITIONS || total < REPETITION_TIME)) {
+		uint64_t start = bench_now();
+		operation(heaplet);
+		uint64_t ns = bench_now() - start;
+		bench_record(&histogram, ns);
+		total += ns;
+	}
+	bench_report(name, &histogram, total, bytes_per_op * histogram.ops, "\"item_size\": %zu, \"items\": %zu", params->item_size, params->items);
+}
+
+static void crawl_workload(void* arg) {
+	const room_params_t* params = arg;
+	void crawl_all(mr_heaplet_t* heaplet) {
+		int count(uint64_t size, char* data, void* extra_args) {
+			(void) size;
+			(void) data;
+			(*((size_t*) extra_args))++;
+			return 0;
+		}
+		size_t items = 0;
+		mr_crawl(heaplet, count, &items);
+	}
+	repeat("crawl", params, crawl_all, params->items * params->item_size, false);
+}
+
+static void early_exit_crawl_workload(void* arg) {
+	const room_params_t* params = arg;
+	void crawl_half(mr_heaplet_t* heaplet) {
+		int count_to_half(uint64_t size, char* data, void* extra_args) {
+			(void) size;
+			(void) data;
+			size_t* items = extra_args;
+			(*items)++;
+			return *items >= params->items / 2;
+		}
+		size_t items = 0;
+		mr_crawl(heaplet, count_to_half, &items);
+	}
+	repeat("crawl_early_exit", params, crawl_half, params->items / 2 * params->item_size, false);
+}
+
+static void array_workload(void* arg) {
+	const room_params_t* params = arg;
+	void round_trip(mr_heaplet_t* heaplet) {
+		size_t size = mr_write_to_array(heaplet, NULL);
+		char* array = malloc(size);
+		mr_write_to_array(heaplet, array);
+		mr_free(mr_read_from_array(array, size));
+		free(array);
+	}
+	repeat("array_round_trip", params, round_trip, params->items * params->item_size, true);
+}
+
+static void file_workload(void* arg) {
+	const room_params_t* params = arg;
+	void round_trip(mr_heaplet_t* heaplet) {
+		FILE* f = tmpfile();
+		mr_write_to_file(heaplet, f);
+		fflush(f);
+		rewind(f);
+		mr_free(mr_read_from_file(f));
+		fclose(f);
+	}
+	repeat("file_round_trip", params, round_trip, params->items * params->item_size, true);
+}
+
+int main(int argc, char** argv) {
+	bench_options_t options;
+	if (!bench_parse_options(argc, argv, &options)) {
+		fprintf(stderr, "Usage: %s [--max-items N] [--max-bytes N] [--only BENCHMARK]\n", argv[0]);
+		return 1;
+	}
+	struct {
+		const char* name;
+		void (*workload)(void* arg);
+		bool both_patterns;
+	} benchmarks[] = {
+		{"insert", insert_workload, true},
+		{"insert_bulk", bulk_insert_workload, false},
+		{"crawl", crawl_workload, false},
+		{"crawl_early_exit", early_exit_crawl_workload, false},
+		{"array_round_trip", array_workload, false},
+		{"file_round_trip", file_workload, false},
+	};
+	bench_begin();
+	for (size_t b=0; b<sizeof(benchmarks)/sizeof(benchmarks[0]); b++) {
+		if (!bench_selected(&options, benchmarks[b].name)) {
+			continue;
+		}
+		for (size_t s=0; s<NUMBER_OF_ITEM_SIZES; s++) {
+			for (size_t items=MIN_ITEMS; items<=options.max_items && items * (item_sizes[s] + sizeof(uint64_t)) <= options.max_bytes; items*=10) {
+				room_params_t params = {item_sizes[s], items, true, 4 * options.max_bytes};
+				bench_run(benchmarks[b].workload, &params);
+				if (benchmarks[b].both_patterns) {
+					params.follow = false;
+					bench_run(benchmarks[b].workload, &params);
+				}
+			}
+		}
+	}
+	bench_end();
+	return 0;
+}
+
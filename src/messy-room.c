@@ -1,9 +1,187 @@
 #include "messy-room.h"
 #include "stdbool.h"
 #include "string.h"
+#include "pthread.h"
+#include "sched.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include "immintrin.h"
+#define MR_X86_KERNELS
+#endif
 
-typedef bool (*mr_reader_function)(void* arg, char* c);
-typedef void (*mr_writer_function)(void* arg, char c);
+typedef void (*mr_writer_function)(void* arg, const char* buffer, size_t n);
+
+/*
+ * State shared by all the heaplets of a messy room.
+ */
+struct mr_room_s {
+	char* mapping;       // File the heaplets' data can be mapped from, or NULL
+	size_t mapping_size;
+	int mapping_flags;
+	char* mapping_directory; // Directory of the mapped file, NULL for the legacy format
+	bool mapping_cursors; // The mapped legacy file has fill cursors
+	size_t mapping_entry_size;
+	struct mr_chunk_s* arena; // Chunk memory is taken from, NULL if malloc is used
+	int placement;
+	uint64_t random_state;
+	mr_heaplet_t** free_list; // Heaplets with room left, for MR_PLACE_FIRST_FIT
+	size_t free_list_size;
+	size_t free_list_capacity;
+	mr_heaplet_t* last_with_room; // For MR_PLACE_LAST_WITH_ROOM
+	mr_sizing_t sizing;
+	mr_heaplet_t* last_made; // Last heaplet made by mr_add_data
+	uint64_t serial; // Unique number of the room, for the home heaplets of threads
+	pthread_mutex_t lock; // Held by concurrent insertions to grow the room
+	void** retired; // Lists of neighbours replaced while concurrent readers may use them
+	size_t retired_count;
+	size_t retired_capacity;
+	mr_heaplet_t* file_root; // Heaplet 0 of the version 2 file last read from or written to, or NULL
+	uint64_t file_base;      // Offset of the messy room in this file
+	uint64_t file_size;
+	uint64_t file_heaplets;
+	uint64_t file_directory;
+	uint64_t file_entry_size;
+	bool structure_changed;  // Heaplets or neighbours have been added since
+	mr_heaplet_t** dirty;    // Heaplets of the file with changed bytes
+	size_t dirty_count;
+	size_t dirty_capacity;
+	mr_heaplet_t** by_address; // All heaplets sorted by the address of their data, for mr_touch
+	size_t by_address_count;
+	bool by_address_stale;
+	mr_counters_t counters; // Only counted with MR_STATS_COUNTERS
+};
+
+/*
+ * An heaplet with what the messy room keeps track of about it, which is not
+ * part of the public mr_heaplet_t. All the heaplets are allocated this way.
+ */
+typedef struct {
+	mr_heaplet_t heaplet;
+	uint64_t file_offset; // Offset of its data in the file the room has last been read from or written to
+	size_t dirty_begin; // Bytes changed since then, none if dirty_end is 0
+	size_t dirty_end;
+	unsigned char* filter; // Bloom filter of the keys added with mr_add_keyed, or NULL
+	size_t filter_size;
+	uint64_t filter_offset; // Of the filter in the file, like file_offset
+	bool filter_dirty;
+	size_t last_reserved; // Offset of the element made by the last mr_reserve, if nothing has been added since
+} mr_heaplet_state_t;
+
+#define MR_NOT_RESERVED SIZE_MAX
+
+/*
+ * Return the private state of an heaplet.
+ */
+static mr_heaplet_state_t* state_of(const mr_heaplet_t* heaplet) {
+	return (mr_heaplet_state_t*) heaplet;
+}
+
+/*
+ * A large block of memory heaplets are carved out of in arena mode. Chunks
+ * are chained from the most recent one.
+ */
+typedef struct mr_chunk_s {
+	struct mr_chunk_s* previous;
+	size_t size;
+	size_t used;
+	char data[];
+} mr_chunk_t;
+
+#define MR_MIN_CHUNK_SIZE (64 * 1024)
+#define MR_MAX_CHUNK_SIZE (64 * 1024 * 1024)
+#define MR_ARENA_ALIGNMENT 16
+
+#define MR_DEFAULT_MIN_SIZE  4096
+#define MR_DEFAULT_GROWTH    2
+#define MR_DEFAULT_ALIGNMENT 4096
+#define MR_DEFAULT_MAX_SIZE  (16 * 1024 * 1024)
+
+#define MR_NOT_IN_FILE UINT64_MAX
+#define MR_PACKED      (UINT64_MAX - 1) // In the file, but elided or encoded so it can't be changed in place
+#define MR_REWRITE     (UINT64_MAX - 2) // Packed and changed since, written whole by mr_sync
+
+/*
+ * Counters of what a messy room goes through are only kept if the library is
+ * compiled with MR_STATS_COUNTERS, as they cost an atomic addition on hot
+ * paths. Without it, the count is evaluated but not used.
+ */
+#ifdef MR_STATS_COUNTERS
+#define MR_COUNT(room, counter, n) __atomic_add_fetch(&(room)->counters.counter, (n), __ATOMIC_RELAXED)
+#else
+#define MR_COUNT(room, counter, n) ((void) (n))
+#endif
+
+#define MR_HOMES 8 // Rooms a thread remembers its home heaplet in
+
+#define MR_DEFAULT_SEED 0x9E3779B97F4A7C15
+#define MR_PROBE_LIMIT  8  // Heaplets looked at by MR_PLACE_BOUNDED_PROBE
+#define MR_MIN_FREE     (2 * sizeof(uint64_t)) // Heaplets with less room left are not in the free list
+
+/*
+ * Heaplets holding elements added with mr_add_keyed have a Bloom filter of
+ * their keys, with a bit per MR_FILTER_DENSITY bytes of the heaplet rounded
+ * to a power of 2 bytes, and MR_FILTER_HASHES bits set per key. Bit i is bit
+ * i % 8 of byte i / 8 so the filter is stored as it is.
+ */
+#define MR_FILTER_DENSITY   4
+#define MR_FILTER_HASHES    4
+#define MR_FILTER_MIN_SIZE  8
+
+/*
+ * Legacy serialization format: the heaplets written depth-first, each one as
+ * its size, its data and the number of its neighbours it has not been reached
+ * from. Since the fill cursors are stored, the stream starts with this magic
+ * number and each size is followed by the fill cursor. Without it, the fill
+ * cursors are found by going through the elements. The magic number is too
+ * big to be the size of an heaplet.
+ */
+#define MR_LEGACY_MAGIC "\x89MRLGC\r\n"
+
+/*
+ * Version 2 of the serialization format. It starts with an header, followed
+ * by a directory with an entry per heaplet, a table of the neighbours of each
+ * heaplet and the data of the heaplets. All fields are 64 bit little endian
+ * numbers. Heaplets are identified by their index in the directory. The first
+ * one is the heaplet the messy room has been written from and the first
+ * neighbour of the other ones is the neighbour they have been reached from.
+ */
+#define MR_V2_MAGIC "\x89MROOM\r\n"
+#define MR_V2_VERSION 2
+
+enum { // Fields of the header
+	MR_V2_HEADER_MAGIC,
+	MR_V2_HEADER_VERSION,
+	MR_V2_HEADER_TOTAL_SIZE,
+	MR_V2_HEADER_HEAPLETS,
+	MR_V2_HEADER_DIRECTORY,       // Offset of the directory
+	MR_V2_HEADER_ENTRY_SIZE,      // Size of a directory entry
+	MR_V2_HEADER_NEIGHBOURS,      // Offset of the neighbour table
+	MR_V2_HEADER_NEIGHBOURS_COUNT,
+	MR_V2_HEADER_FIELDS,
+};
+
+enum { // Fields of a directory entry
+	MR_V2_ENTRY_DATA,             // Offset of the heaplet's data
+	MR_V2_ENTRY_HEAPLET_SIZE,
+	MR_V2_ENTRY_USED,
+	MR_V2_ENTRY_STORED,           // Bytes of data stored, the rest of the heaplet is 0
+	MR_V2_ENTRY_ENCODING,
+	MR_V2_ENTRY_CHECKSUM,         // Checksum of the stored bytes, 0 if unknown
+	MR_V2_ENTRY_FIRST_NEIGHBOUR,  // Index of its first neighbour in the neighbour table
+	MR_V2_ENTRY_NEIGHBOURS,
+	MR_V2_ENTRY_FILTER,           // Offset of the Bloom filter of its keys
+	MR_V2_ENTRY_FILTER_SIZE,      // 0 if it has none
+	MR_V2_ENTRY_FIELDS,
+};
+
+#define MR_V2_HEADER_BYTES (MR_V2_HEADER_FIELDS * sizeof(uint64_t))
+#define MR_V2_ENTRY_BYTES  (MR_V2_ENTRY_FIELDS * sizeof(uint64_t))
+#define MR_V2_ENTRY_MIN_BYTES (MR_V2_ENTRY_FILTER * sizeof(uint64_t)) // Entries written before filters
+#define MR_ENCODING_RAW 0
+#define MR_ENCODING_LZ  1 // The used bytes compressed with lz_compress
 
 /*
  * Prints info about an heaplet.
@@ -18,355 +196,3468 @@ static void __attribute__ ((unused)) print_heaplet(const mr_heaplet_t* heaplet)
 }
 
 /*
- * As the data in a heaplet is made of a t-v data, we can crawl through it to
- * find the next empty chunk.
+ * Writte a 64 bit number in a little endian fashion in a buffer.
  */
-static char* next_intem_in_heaplet(char* data) {
-	uint64_t item_size = *((uint64_t*) data);
-	return data + sizeof(uint64_t) + item_size;
+static void encode_64_le(char* dest, uint64_t n) {
+	for (unsigned int i=0; i<sizeof(uint64_t); i++) {
+		dest[i] = (n >> (8 * i)) & 0xFF;
+	}
 }
 
 /*
- * Returns the next free space in an heaplet buffer, return NULL if there is
- * no more free place.
+ * Read a 64 bit number in little endian from a buffer.
  */
-static char* goto_empty_space(mr_heaplet_t* heaplet) {
-	if (heaplet->size == 0) {
-		return NULL;
+static uint64_t decode_64_le(const char* src) {
+	uint64_t ret = 0;
+	for (unsigned int i=0; i<sizeof(uint64_t); i++) {
+		ret |= ((uint64_t) (unsigned char) src[i]) << (8 * i);
 	}
-	char* next_free_space = heaplet->data;
-	while (*((uint64_t*) next_free_space) != 0) {
-		next_free_space = next_intem_in_heaplet(next_free_space);
-		if ((size_t) (next_free_space - heaplet->data) >= heaplet->size) {
-			return NULL;
-		}
+	return ret;
+}
+
+/*
+ * Last serial number given to a room, 0 is never used.
+ */
+static uint64_t room_serials = 0;
+
+/*
+ * Create the state of a new messy room.
+ */
+static mr_room_t* new_room(void) {
+	mr_room_t* ret = malloc(sizeof(mr_room_t));
+	ret->mapping = NULL;
+	ret->mapping_size = 0;
+	ret->mapping_flags = 0;
+	ret->mapping_directory = NULL;
+	ret->mapping_cursors = false;
+	ret->mapping_entry_size = 0;
+	ret->arena = NULL;
+	ret->placement = MR_PLACE_RANDOM_WALK;
+	ret->random_state = MR_DEFAULT_SEED;
+	ret->free_list = NULL;
+	ret->free_list_size = 0;
+	ret->free_list_capacity = 0;
+	ret->last_with_room = NULL;
+	ret->sizing.min_size = MR_DEFAULT_MIN_SIZE;
+	ret->sizing.growth = MR_DEFAULT_GROWTH;
+	ret->sizing.alignment = MR_DEFAULT_ALIGNMENT;
+	ret->sizing.max_size = MR_DEFAULT_MAX_SIZE;
+	ret->last_made = NULL;
+	ret->serial = __atomic_add_fetch(&room_serials, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&ret->lock, NULL);
+	ret->retired = NULL;
+	ret->retired_count = 0;
+	ret->retired_capacity = 0;
+	ret->file_root = NULL;
+	ret->file_base = 0;
+	ret->file_size = 0;
+	ret->file_heaplets = 0;
+	ret->file_directory = 0;
+	ret->file_entry_size = 0;
+	ret->structure_changed = false;
+	ret->dirty = NULL;
+	ret->dirty_count = 0;
+	ret->dirty_capacity = 0;
+	ret->by_address = NULL;
+	ret->by_address_count = 0;
+	ret->by_address_stale = true;
+	memset(&ret->counters, 0, sizeof(mr_counters_t));
+	return ret;
+}
+
+/*
+ * Bring a heaplet size down to the maximum size of a sizing policy, but not
+ * below needed bytes, and round it up to its alignment.
+ */
+static size_t clamp_heaplet_size(const mr_sizing_t* sizing, size_t size, size_t needed) {
+	if (sizing->max_size != 0 && size > sizing->max_size) {
+		size = sizing->max_size;
 	}
-	return next_free_space;
+	if (size < needed) {
+		size = needed;
+	}
+	if (sizing->alignment > 1 && size % sizing->alignment != 0 && size < SIZE_MAX - sizing->alignment) {
+		size += sizing->alignment - size % sizing->alignment;
+	}
+	return size;
 }
 
 /*
- * Returns the empty space in a heaplet's buffer.
+ * Choose the size of a new neighbour of an heaplet which must be able to hold
+ * at least needed bytes, according to the sizing policy of the room. It is
+ * made bigger for wanted bytes, such as a batch of elements, if the maximum
+ * size allows it.
  */
-static size_t empty_space(mr_heaplet_t* heaplet) {
-	const char* next_free_space = goto_empty_space(heaplet);
-	if (next_free_space == NULL) {
-		return 0;
+static size_t next_heaplet_size(const mr_heaplet_t* heaplet, size_t needed, size_t wanted) {
+	const mr_sizing_t* sizing = &heaplet->room->sizing;
+	size_t size = heaplet->size > SIZE_MAX / sizing->growth ? SIZE_MAX : heaplet->size * sizing->growth;
+	if (size < sizing->min_size) {
+		size = sizing->min_size;
 	}
-	return heaplet->size - (next_free_space - heaplet->data);
+	if (size < wanted) {
+		size = wanted;
+	}
+	return clamp_heaplet_size(sizing, size, needed);
 }
 
 /*
- * Assuming there is enough place in it, adds data into an heaplet's buffer
+ * Give the next number of the pseudo random generator of a messy room, a
+ * xorshift64*.
  */
-static void add_data(mr_heaplet_t* heaplet, size_t size, const void* data) {
-	char* target = goto_empty_space(heaplet);
-	*((uint64_t*) target) = size;
-	target += sizeof(uint64_t);
-	memmove(target, data, size);
+static uint64_t room_random(mr_room_t* room) {
+	uint64_t x = room->random_state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	room->random_state = x;
+	return x * 0x2545F4914F6CDD1D;
 }
 
 /*
- * Create a new heaplet, if the neighbor is set to NULL, the list of neighbour
- * will be left empty.
+ * Add a new chunk to the arena of a messy room, big enough for size bytes.
+ * Chunks get bigger as the arena grows.
  */
-static mr_heaplet_t* new_heaplet(size_t size, mr_heaplet_t* neighbour) {
-	mr_heaplet_t* ret = malloc(sizeof(mr_heaplet_t));
-	ret->size = size;
-	ret->data = calloc(size, 1);
-	if (neighbour == NULL) {
-		ret->number_of_neighbours = 0;
-		ret->neighbours = NULL;
-	} else {
-		ret->number_of_neighbours = 1;
-		ret->neighbours = malloc(sizeof(neighbour));
-		ret->neighbours[0] = neighbour;
+static void new_chunk(mr_room_t* room, size_t size) {
+	size_t chunk_size = room->arena == NULL ? MR_MIN_CHUNK_SIZE : room->arena->size * 2;
+	if (chunk_size > MR_MAX_CHUNK_SIZE) {
+		chunk_size = MR_MAX_CHUNK_SIZE;
 	}
-	return ret;
+	if (chunk_size < size) {
+		chunk_size = size;
+	}
+	mr_chunk_t* chunk = calloc(sizeof(mr_chunk_t) + chunk_size, 1);
+	chunk->previous = room->arena;
+	chunk->size = chunk_size;
+	chunk->used = 0;
+	room->arena = chunk;
 }
 
 /*
- * Randomly select a next heaplet to put data in. If a new heaplet must be
- * created, NULL is returned.
- * There is 1/3 chances of a new heaplet being made. If a neighbour is choosen,
- * all of the neighbours have equal chances.
+ * Allocate zeroed memory for a messy room, from its arena if it has one.
  */
-static mr_heaplet_t* choose_next_heaplet(const mr_heaplet_t* heaplet) {
-	if (heaplet->number_of_neighbours == 0) {
-		return NULL;
+static void* room_alloc(mr_room_t* room, size_t size) {
+	if (room->arena == NULL) {
+		return calloc(size, 1);
 	}
-	if (rand() % 3 == 0) {
-		return NULL;
+	size = (size + MR_ARENA_ALIGNMENT - 1) & ~((size_t) MR_ARENA_ALIGNMENT - 1);
+	if (room->arena->size - room->arena->used < size) {
+		new_chunk(room, size);
 	}
-	return heaplet->neighbours[
-		rand() % heaplet->number_of_neighbours];
+	void* ret = room->arena->data + room->arena->used;
+	room->arena->used += size;
+	return ret;
 }
 
 /*
- * Add a new heaplet to the list of neighbours of an other heaplet.
+ * Free memory allocated with room_alloc. Arena memory is only released with
+ * the whole arena.
  */
-static void new_neighbour(mr_heaplet_t* heaplet, mr_heaplet_t* neighbour) {
-	mr_heaplet_t** new_buffer = malloc(sizeof(mr_heaplet_t) * (heaplet->number_of_neighbours + 1));
-	for (size_t i=0; i<heaplet->number_of_neighbours; i++) {
-		new_buffer[i] = heaplet->neighbours[i];
+static void room_release(mr_room_t* room, void* ptr) {
+	if (room->arena == NULL) {
+		free(ptr);
 	}
-	new_buffer[heaplet->number_of_neighbours] = neighbour;
-	heaplet->number_of_neighbours++;
-	free(heaplet->neighbours);
-	heaplet->neighbours = new_buffer;
 }
 
 /*
- * Writte a 64 bit number in a little endian fashion.
+ * Free the state of a messy room, once all its heaplets have been freed.
  */
-static int serlial_64_le(void* arg, uint64_t n, mr_writer_function f) {
-	for (unsigned int i=0; i<sizeof(uint64_t); i++) {
-		f(arg, (n >> (8 * i)) & 0xFF);
+static void free_room(mr_room_t* room) {
+	if (room->mapping != NULL) {
+		munmap(room->mapping, room->mapping_size);
+	}
+	while (room->arena != NULL) {
+		mr_chunk_t* previous = room->arena->previous;
+		free(room->arena);
+		room->arena = previous;
 	}
-	return sizeof(uint64_t);
+	for (size_t i=0; i<room->retired_count; i++) {
+		free(room->retired[i]);
+	}
+	free(room->retired);
+	free(room->free_list);
+	free(room->dirty);
+	free(room->by_address);
+	pthread_mutex_destroy(&room->lock);
+	free(room);
 }
 
 /*
- * Serialize a messy room by generating each char and putting using the result
- * in the given callback.
- * Return the number of char serialized.
+ * Tell if the data of an heaplet lies in a mapped file instead of being
+ * allocated for it.
  */
-static size_t serialize_mr(void* arg, const mr_heaplet_t* heaplet, mr_writer_function f, bool first_call) {
-	size_t ret = 0;
-	ret += serlial_64_le(arg, heaplet->size, f);
-	for (size_t i=0; i<heaplet->size; i++) {
-		f(arg, heaplet->data[i]);
-		ret++;
+static bool is_mapped(const mr_heaplet_t* heaplet) {
+	const mr_room_t* room = heaplet->room;
+	return room->mapping != NULL && heaplet->data >= room->mapping && heaplet->data < room->mapping + room->mapping_size;
+}
+
+/*
+ * Keep the fill cursor of a mapped heaplet up to date in the file. Legacy
+ * files without fill cursors need none, their elements end at the first 0
+ * size, and the bytes after the fill cursor are always 0.
+ */
+static void write_mapped_fill_cursor(const mr_heaplet_t* heaplet) {
+	const mr_room_t* room = heaplet->room;
+	if (!is_mapped(heaplet)) {
+		return;
 	}
-	serlial_64_le(arg, first_call ? heaplet->number_of_neighbours : heaplet->number_of_neighbours - 1, f);
-	for(size_t i = (first_call ? 0 : 1); i<heaplet->number_of_neighbours; i++) {
-		ret += serialize_mr(arg, heaplet->neighbours[i], f, false);
+	if (room->mapping_directory != NULL) {
+		encode_64_le(room->mapping_directory + heaplet->id * room->mapping_entry_size + MR_V2_ENTRY_USED * sizeof(uint64_t), heaplet->used);
+	} else if (room->mapping_cursors) { // Right before the data in the legacy format
+		encode_64_le(heaplet->data - sizeof(uint64_t), heaplet->used);
 	}
+}
+
+/*
+ * As the data in a heaplet is made of a t-v data, we can crawl through it to
+ * find the next empty chunk.
+ */
+static char* next_intem_in_heaplet(char* data) {
+	uint64_t item_size = *((uint64_t*) data);
+	return data + sizeof(uint64_t) + item_size;
+}
+
+/*
+ * Read the fill cursor of an heaplet which might be filled concurrently. All
+ * the elements before it are complete.
+ */
+static size_t published_used(const mr_heaplet_t* heaplet) {
+	return __atomic_load_n(&heaplet->used, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Read the list of neighbours of an heaplet which might grow concurrently.
+ * The count is read first as the list is always replaced before the count is
+ * raised.
+ */
+static size_t published_neighbours(const mr_heaplet_t* heaplet, mr_heaplet_t*** neighbours) {
+	size_t ret = __atomic_load_n(&heaplet->number_of_neighbours, __ATOMIC_ACQUIRE);
+	*neighbours = __atomic_load_n(&heaplet->neighbours, __ATOMIC_ACQUIRE);
 	return ret;
 }
 
 /*
- * Read a 64 bit number in little endian.
- * Return true if it can be done and false otherwize.
+ * Returns the next free space in an heaplet buffer, return NULL if there is
+ * no more free place. The fill cursor is kept up to date on each insertion so
+ * there is no need to crawl through the items.
  */
-static bool deserial_64_le(void* arg, uint64_t* n, mr_reader_function f) {
-	*n = 0;
-	for (unsigned int i=0; i<sizeof(uint64_t); i++) {
-		char read;
-		bool rc = f(arg, &read);
-		if (!rc) {
-			return false;
-		}
-		*n |= ((uint64_t) read) << (8 * i);
+static char* goto_empty_space(mr_heaplet_t* heaplet) {
+	if (heaplet->used >= heaplet->size) {
+		return NULL;
 	}
-	return true;
+	return heaplet->data + heaplet->used;
 }
 
-static mr_heaplet_t* deserialize_mr(void* arg, mr_reader_function f, mr_heaplet_t* previous_heaplet) {
-	// Reading data
-	uint64_t size;
-	if (!deserial_64_le(arg, &size, f)) {
-		return NULL;
+/*
+ * Returns the empty space in a heaplet's buffer.
+ */
+static size_t empty_space(const mr_heaplet_t* heaplet) {
+	if (heaplet->room->mapping_flags == MR_MAP_READ_ONLY && is_mapped(heaplet)) {
+		return 0;
 	}
-	mr_heaplet_t* ret = new_heaplet(size, NULL);
-	for (uint64_t i=0; i<size; i++) {
-		char read;
-		if (!f(arg, &read)) {
-			fprintf(stderr, "[MESSY ROOM] Error, unable to read needed char.\n");
-			mr_free(ret);
-			return NULL;
-		}
-		ret->data[i] = read;
+	return heaplet->size - heaplet->used;
+}
+
+/*
+ * Clear the checksum of an heaplet of a file mapped with MR_MAP_SHARED whose
+ * data changes, as it would no longer match. The checksums of the heaplets
+ * left untouched are kept.
+ */
+static void unverify_mapped(const mr_heaplet_t* heaplet) {
+	const mr_room_t* room = heaplet->room;
+	if (room->mapping_flags != MR_MAP_SHARED || room->mapping_directory == NULL || !is_mapped(heaplet)) {
+		return;
 	}
-	// Reading neighbours
-	if (!deserial_64_le(arg, &ret->number_of_neighbours, f)) {
-		fprintf(stderr, "[MESSY ROOM] Error, unable to read number of neighbours.\n");
-		mr_free(ret);
-		return NULL;
+	char* field = room->mapping_directory + heaplet->id * room->mapping_entry_size + MR_V2_ENTRY_CHECKSUM * sizeof(uint64_t);
+	if (decode_64_le(field) != 0) {
+		encode_64_le(field, 0);
 	}
-	if (previous_heaplet != NULL) {
-		ret->number_of_neighbours++;
+}
+
+/*
+ * Note that bytes of an heaplet have changed since the room has been read
+ * from or written to a file, so that mr_sync writes them back.
+ */
+static void mark_dirty(mr_heaplet_t* heaplet, size_t begin, size_t end) {
+	mr_heaplet_state_t* state = state_of(heaplet);
+	mr_room_t* room = heaplet->room;
+	if (begin < end) {
+		unverify_mapped(heaplet);
 	}
-	ret->neighbours = malloc(sizeof(mr_heaplet_t*) * ret->number_of_neighbours);
-	for (size_t i=0; i<ret->number_of_neighbours; i++) {
-		ret->neighbours[i] = NULL; // Ensure no segfault if the deserialization must be aborted.
+	if (state->file_offset == MR_PACKED && begin < end) {
+		state->file_offset = MR_REWRITE;
+		room->structure_changed = true; // Its directory entry has to change
 	}
-	uint64_t first_index = previous_heaplet == NULL ? 0 : 1;
-	if (previous_heaplet != NULL) {
-		ret->neighbours[0] = previous_heaplet;
+	if (state->file_offset == MR_NOT_IN_FILE || state->file_offset == MR_REWRITE || begin >= end) {
+		return; // Written whole by mr_sync
 	}
-	for (uint64_t i=first_index; i<ret->number_of_neighbours; i++) {
-		mr_heaplet_t* neighbour = deserialize_mr(arg, f, ret);
-		if (neighbour == NULL) {
-			fprintf(stderr, "[MESSY ROOM] Error, unable to neighbours.\n");
-			mr_free(ret);
-			return NULL;
+	if (state->dirty_end == 0) {
+		if (room->dirty_count == room->dirty_capacity) {
+			room->dirty_capacity = room->dirty_capacity < 8 ? 16 : room->dirty_capacity * 2;
+			room->dirty = realloc(room->dirty, sizeof(mr_heaplet_t*) * room->dirty_capacity);
 		}
-		ret->neighbours[i] = neighbour;
+		room->dirty[room->dirty_count] = heaplet;
+		room->dirty_count++;
+		state->dirty_begin = begin;
+		state->dirty_end = end;
+	}
+	if (begin < state->dirty_begin) {
+		state->dirty_begin = begin;
+	}
+	if (end > state->dirty_end) {
+		state->dirty_end = end;
 	}
-	return ret;
 }
 
-
 /*
- * Create a new empty heaplet with no neighbour.
+ * Assuming there is enough place in it, adds data into an heaplet's buffer.
+ * If data is NULL, the bytes of the element are left as they are, all 0.
  */
-mr_heaplet_t* mr_new(void) {
-	return new_heaplet(0, NULL);
+static void add_data(mr_heaplet_t* heaplet, size_t size, const void* data) {
+	char* target = goto_empty_space(heaplet);
+	mark_dirty(heaplet, heaplet->used, heaplet->used + sizeof(uint64_t) + size);
+	*((uint64_t*) target) = size;
+	target += sizeof(uint64_t);
+	if (data != NULL) {
+		memmove(target, data, size);
+	}
+	heaplet->used += sizeof(uint64_t) + size;
+	heaplet->reserved = heaplet->used;
+	state_of(heaplet)->last_reserved = MR_NOT_RESERVED;
+	write_mapped_fill_cursor(heaplet);
 }
 
 /*
- * Free a heaplet and all its neighbours, recursively.
+ * Size of the Bloom filter of an heaplet of the given size.
  */
-void mr_free(mr_heaplet_t* heaplet) {
-
-	void _mr_free(mr_heaplet_t* heaplet, const mr_heaplet_t* last_freed) {
-		for (size_t i=0; i<heaplet->number_of_neighbours; i++) {
-			mr_heaplet_t* target = heaplet->neighbours[i];
-			if (target != last_freed && target != NULL) {
-				_mr_free(target, heaplet);
-			}
-		}
-		free(heaplet->data);
-		free(heaplet->neighbours);
-		free(heaplet);
+static size_t filter_size(size_t heaplet_size) {
+	size_t ret = MR_FILTER_MIN_SIZE;
+	while (ret * 8 * MR_FILTER_DENSITY < heaplet_size) {
+		ret *= 2;
 	}
-
-	_mr_free(heaplet, NULL);
+	return ret;
 }
 
 /*
- * Add data into a heaplet. If there is not enought space, a neighbour or a new
- * heaplet will be chosen. The heaplet choosen is returned.
+ * Give an heaplet an empty Bloom filter if it has none. A heaplet has a filter
+ * only as long as all its elements are in it.
  */
-mr_heaplet_t* mr_add_data(mr_heaplet_t* heaplet, size_t size, const void* data) {
-	if (size + sizeof(uint64_t) <= empty_space(heaplet)) {
-		add_data(heaplet, size, data);
-		return heaplet;
+static void ensure_filter(mr_heaplet_t* heaplet) {
+	mr_heaplet_state_t* state = state_of(heaplet);
+	if (state->filter != NULL) {
+		return;
 	}
-	mr_heaplet_t* next_heaplet = choose_next_heaplet(heaplet);
-	if (next_heaplet == NULL) {
-		next_heaplet = new_heaplet((size + sizeof(uint64_t)) * heaplet->number_of_neighbours, heaplet);
-		new_neighbour(heaplet, next_heaplet);
+	state->filter_size = filter_size(heaplet->size);
+	state->filter = room_alloc(heaplet->room, state->filter_size);
+	if (state->file_offset != MR_NOT_IN_FILE) {
+		heaplet->room->structure_changed = true; // The filter has to be appended to the file
 	}
-	return mr_add_data(next_heaplet, size, data);
 }
 
-
 /*
- * Execute a function on each element of the messy room. The function takes the
- * size and the content of each element and an extra pointer that can be used
- * to give arguments to the function.
- * If the function f returns 0, the next element is searched throught,
- * otherwize, mr_crawl returns the exit code of the function f.
- * If all function calls on all elements in the messy room have returned 0,
- * mr_crawl returns 0.
+ * Remove the filter of an heaplet, once it holds an element it does not
+ * account for.
  */
-int mr_crawl(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args) {
+static void drop_filter(mr_heaplet_t* heaplet) {
+	mr_heaplet_state_t* state = state_of(heaplet);
+	if (state->filter == NULL) {
+		return;
+	}
+	room_release(heaplet->room, state->filter);
+	state->filter = NULL;
+	state->filter_size = 0;
+	state->filter_dirty = false;
+	if (state->filter_offset != MR_NOT_IN_FILE) {
+		state->filter_offset = MR_NOT_IN_FILE;
+		heaplet->room->structure_changed = true; // Its directory entry has to change
+	}
+}
 
-	int _mr_crawl(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args, const mr_heaplet_t* previous_heaplet) {
-		char* end_of_data = goto_empty_space(heaplet);
-		char* data = heaplet->data;
-		if (end_of_data == NULL) {
-			end_of_data = data + heaplet->size;
-		}
-		while(data < end_of_data) {
-			int rc = f(*((uint64_t*) data), data + sizeof(uint64_t), extra_args);
-			if (rc) {
-				return rc;
-			}
-			data = next_intem_in_heaplet(data);
-		}
-		for (size_t i=0; i<heaplet->number_of_neighbours; i++) {
-			mr_heaplet_t* neighbour = heaplet->neighbours[i];
-			if (neighbour != previous_heaplet) {
-				int rc = _mr_crawl(neighbour, f, extra_args, heaplet);
-				if (rc) {
-					return rc;
-				}
-			}
+/*
+ * Set or test the bits of a key in a Bloom filter, given the hash of the key.
+ * The bits are picked by double hashing. Return true if they were all set.
+ */
+static bool filter_bits(unsigned char* filter, size_t size, uint64_t hash, bool set) {
+	uint64_t step = (hash >> 32 | hash << 32) | 1;
+	bool ret = true;
+	for (unsigned int i=0; i<MR_FILTER_HASHES; i++) {
+		uint64_t bit = hash & (size * 8 - 1);
+		ret = ret && (filter[bit / 8] & (1 << (bit % 8)));
+		if (set) {
+			filter[bit / 8] |= 1 << (bit % 8);
 		}
-		return 0;
+		hash += step;
+	}
+	return ret;
+}
+
+/*
+ * Add the keys of a Bloom filter to another one. As their sizes are powers of
+ * 2, the bits of a bigger filter are folded and those of a smaller one are
+ * repeated, which keeps every key.
+ */
+static void merge_filter(unsigned char* dest, size_t dest_size, const unsigned char* src, size_t src_size) {
+	size_t n = dest_size > src_size ? dest_size : src_size;
+	for (size_t i=0; i<n; i++) {
+		dest[i % dest_size] |= src[i % src_size];
 	}
+}
 
-	return _mr_crawl(heaplet, f, extra_args, NULL);
+/*
+ * Tell if an heaplet has to be searched for a key of the given hash: if it
+ * has no filter or if its filter may hold the key.
+ */
+static bool may_hold_key(const mr_heaplet_t* heaplet, uint64_t hash) {
+	return state_of(heaplet)->filter == NULL || filter_bits(state_of(heaplet)->filter, state_of(heaplet)->filter_size, hash, false);
 }
 
 /*
- * Write the content of a messy room to an array, it the given array is NULL,
- * nothing is written.
- * Return the number of char needed to serialize the messy room.
+ * Create a new heaplet without any neighbour in the given messy room.
  */
-size_t mr_write_to_array(mr_heaplet_t* heaplet, char* dest) {
-	struct to_array_s {
-		char* data;
-		size_t index;
-	};
+static mr_heaplet_t* new_first_heaplet(mr_room_t* room, size_t size) {
+	mr_heaplet_state_t* state = room_alloc(room, sizeof(mr_heaplet_state_t));
+	state->file_offset = MR_NOT_IN_FILE;
+	state->dirty_begin = 0;
+	state->dirty_end = 0;
+	state->filter = NULL;
+	state->filter_size = 0;
+	state->filter_offset = MR_NOT_IN_FILE;
+	state->filter_dirty = false;
+	state->last_reserved = MR_NOT_RESERVED;
+	mr_heaplet_t* ret = &state->heaplet;
+	ret->room = room;
+	ret->id = 0;
+	ret->size = size;
+	ret->used = 0;
+	ret->reserved = 0;
+	room->by_address_stale = true;
+	ret->data = room_alloc(room, size);
+	ret->number_of_neighbours = 0;
+	ret->neighbours_capacity = 0;
+	ret->neighbours = NULL;
+	return ret;
+}
 
-	void write_to_array(void* arg, char c) {
-		struct to_array_s* context = arg;
-		context->data[context->index] = c;
-		context->index++;
+/*
+ * Ensure that the list of neighbours of an heaplet can hold capacity of them.
+ */
+static void reserve_neighbours(mr_heaplet_t* heaplet, size_t capacity) {
+	if (capacity <= heaplet->neighbours_capacity) {
+		return;
+	}
+	mr_heaplet_t** new_buffer = room_alloc(heaplet->room, sizeof(mr_heaplet_t*) * capacity);
+	if (heaplet->number_of_neighbours > 0) {
+		memcpy(new_buffer, heaplet->neighbours, sizeof(mr_heaplet_t*) * heaplet->number_of_neighbours);
 	}
+	room_release(heaplet->room, heaplet->neighbours);
+	heaplet->neighbours = new_buffer;
+	heaplet->neighbours_capacity = capacity;
+}
 
-	void do_nothing(void* _arg, char _c) {
-		(void) _arg;
-		(void) _c;
+/*
+ * Create a new heaplet, if the neighbor is set to NULL, the list of neighbour
+ * will be left empty and the heaplet will be the first of a new messy room.
+ */
+static mr_heaplet_t* new_heaplet(size_t size, mr_heaplet_t* neighbour) {
+	if (neighbour == NULL) {
+		return new_first_heaplet(new_room(), size);
 	}
+	mr_heaplet_t* ret = new_first_heaplet(neighbour->room, size);
+	reserve_neighbours(ret, 1);
+	ret->number_of_neighbours = 1;
+	ret->neighbours[0] = neighbour;
+	return ret;
+}
 
-	if (dest == NULL) {
-		return serialize_mr(NULL, heaplet, do_nothing, true);
-	} else {
-		struct to_array_s context = {.data = dest, .index = 0};
-		return serialize_mr(&context, heaplet, write_to_array, true);
+/*
+ * Randomly select a next heaplet to put data in. If a new heaplet must be
+ * created, NULL is returned.
+ * There is 1/3 chances of a new heaplet being made. If a neighbour is choosen,
+ * all of the neighbours have equal chances.
+ */
+static mr_heaplet_t* choose_next_heaplet(const mr_heaplet_t* heaplet) {
+	if (heaplet->number_of_neighbours == 0) {
+		return NULL;
 	}
+	if (room_random(heaplet->room) % 3 == 0) {
+		return NULL;
+	}
+	return heaplet->neighbours[
+		room_random(heaplet->room) % heaplet->number_of_neighbours];
 }
 
 /*
- * Write the content of a messy room to a file.
+ * Add a new heaplet to the list of neighbours of an other heaplet. The list
+ * grows geometrically.
  */
-size_t mr_write_to_file(mr_heaplet_t* heaplet, FILE* f) {
-	void write_to_file(void* arg, char c) {
-		FILE* f = arg;
-		fputc(c, f);	
+static void new_neighbour(mr_heaplet_t* heaplet, mr_heaplet_t* neighbour) {
+	heaplet->room->structure_changed = true;
+	if (heaplet->number_of_neighbours == heaplet->neighbours_capacity) {
+		reserve_neighbours(heaplet, heaplet->neighbours_capacity < 2 ? 4 : heaplet->neighbours_capacity * 2);
 	}
-	
-	return serialize_mr(f, heaplet, write_to_file, true);
+	heaplet->neighbours[heaplet->number_of_neighbours] = neighbour;
+	heaplet->number_of_neighbours++;
 }
 
 /*
- * Read a messy room serialized in an array.
+ * Add an heaplet at the end of the free list of its room.
  */
-mr_heaplet_t* mr_read_from_array(char* data, size_t size) {
-	struct from_array_s {
-		char* data;
-		size_t size;
-		size_t index;
-	};
+static void free_list_push(mr_heaplet_t* heaplet) {
+	mr_room_t* room = heaplet->room;
+	if (empty_space(heaplet) < MR_MIN_FREE) {
+		return;
+	}
+	if (room->free_list_size == room->free_list_capacity) {
+		room->free_list_capacity = room->free_list_capacity < 8 ? 16 : room->free_list_capacity * 2;
+		room->free_list = realloc(room->free_list, sizeof(mr_heaplet_t*) * room->free_list_capacity);
+	}
+	room->free_list[room->free_list_size] = heaplet;
+	room->free_list_size++;
+}
 
-	bool read_byte(void* arg, char* c) {
-		struct from_array_s* context = arg;
-		if (context->index < context->size) {
-			*c = context->data[context->index];
-			context->index++;
-			return true;
+/*
+ * Find the first heaplet of the free list with enough room for needed
+ * bytes, or NULL if there is none. Heaplets that are nearly full are removed
+ * from the list on the way.
+ */
+static mr_heaplet_t* free_list_first_fit(mr_room_t* room, size_t needed) {
+	size_t kept = 0;
+	mr_heaplet_t* ret = NULL;
+	size_t i;
+	for (i=0; i<room->free_list_size && ret == NULL; i++) {
+		mr_heaplet_t* heaplet = room->free_list[i];
+		size_t space = empty_space(heaplet);
+		if (space < MR_MIN_FREE) {
+			continue;
 		}
-		return false;
+		if (needed <= space) {
+			ret = heaplet;
+		}
+		room->free_list[kept] = heaplet;
+		kept++;
 	}
-	
-	struct from_array_s context = {.data = data, .size = size, .index = 0};
-	return deserialize_mr(&context, read_byte, NULL);
+	memmove(room->free_list + kept, room->free_list + i, sizeof(mr_heaplet_t*) * (room->free_list_size - i));
+	room->free_list_size = kept + room->free_list_size - i;
+	return ret;
 }
 
 /*
- * Read a messy room serialized in a file.
+ * Set the neighbours of an heaplet being deserialized: the one it has been
+ * reached from, if any, followed by number_of_neighbours empty heaplets to
+ * be filled later.
  */
-mr_heaplet_t* mr_read_from_file(FILE* f) {
-	bool read_byte(void* arg, char* c) {
-		int ch = fgetc((FILE*) arg);
-		*c = ch;
-		return ch != EOF;
+static void add_empty_neighbours(mr_heaplet_t* heaplet, const mr_heaplet_t* previous, uint64_t number_of_neighbours) {
+	heaplet->number_of_neighbours = 0;
+	reserve_neighbours(heaplet, number_of_neighbours + 1);
+	if (previous != NULL) {
+		heaplet->neighbours[0] = (mr_heaplet_t*) previous;
+		heaplet->number_of_neighbours++;
+	}
+	for (uint64_t i=0; i<number_of_neighbours; i++) {
+		heaplet->neighbours[heaplet->number_of_neighbours] = new_heaplet(0, heaplet);
+		heaplet->number_of_neighbours++;
 	}
-	
-	return deserialize_mr(f, read_byte, NULL);
 }
 
+/*
+ * A step of a traversal of a messy room: an heaplet, the neighbour it has
+ * been reached from and the position of that neighbour in the traversal.
+ */
+typedef struct {
+	mr_heaplet_t* heaplet;
+	const mr_heaplet_t* previous;
+	size_t previous_index;
+} mr_step_t;
+
+#define MR_NO_INDEX SIZE_MAX
+
+/*
+ * State of an iterative depth-first traversal of a messy room. The heaplets
+ * still to be visited are kept on an explicit stack so that deep rooms can't
+ * overflow the call stack.
+ */
+typedef struct {
+	mr_step_t* stack;
+	size_t depth;
+	size_t capacity;
+	mr_step_t current;
+	bool expanded;
+	size_t visited;
+} mr_walker_t;
+
+/*
+ * Push an heaplet on the stack of heaplets to visit.
+ */
+static void walker_push(mr_walker_t* walker, mr_heaplet_t* heaplet, const mr_heaplet_t* previous, size_t previous_index) {
+	if (walker->depth == walker->capacity) {
+		walker->capacity = walker->capacity == 0 ? 64 : walker->capacity * 2;
+		walker->stack = realloc(walker->stack, sizeof(mr_step_t) * walker->capacity);
+	}
+	walker->stack[walker->depth].heaplet = heaplet;
+	walker->stack[walker->depth].previous = previous;
+	walker->stack[walker->depth].previous_index = previous_index;
+	walker->depth++;
+}
+
+/*
+ * Start a traversal of the messy room from the given heaplet.
+ */
+static void walker_init(mr_walker_t* walker, mr_heaplet_t* start) {
+	walker->stack = NULL;
+	walker->depth = 0;
+	walker->capacity = 0;
+	walker->current.heaplet = NULL;
+	walker->current.previous = NULL;
+	walker->current.previous_index = MR_NO_INDEX;
+	walker->expanded = true;
+	walker->visited = 0;
+	walker_push(walker, start, NULL, MR_NO_INDEX);
+}
+
+/*
+ * Schedule the neighbours of the current heaplet, except the one it has been
+ * reached from. They are pushed backward to be visited in order. The data of
+ * the next heaplet to visit is prefetched while the current one is processed.
+ * Once this is done, the walker won't look at the current heaplet anymore.
+ */
+static void walker_expand(mr_walker_t* walker) {
+	if (walker->expanded) {
+		return;
+	}
+	walker->expanded = true;
+	mr_heaplet_t* heaplet = walker->current.heaplet;
+	mr_heaplet_t** neighbours;
+	for (size_t i=published_neighbours(heaplet, &neighbours); i>0; i--) {
+		mr_heaplet_t* neighbour = neighbours[i-1];
+		if (neighbour != walker->current.previous && neighbour != NULL) {
+			walker_push(walker, neighbour, heaplet, walker->visited - 1);
+		}
+	}
+	if (walker->depth > 0) {
+		__builtin_prefetch(walker->stack[walker->depth - 1].heaplet->data);
+	}
+}
+
+/*
+ * Return the next heaplet of the traversal or NULL once all heaplets have
+ * been visited. Heaplets are numbered from 0 in the order they are returned.
+ * The neighbours of the previously returned heaplet are read at this point if
+ * walker_expand has not been called, so they can be filled in between.
+ */
+static mr_heaplet_t* walker_next(mr_walker_t* walker) {
+	walker_expand(walker);
+	if (walker->depth == 0) {
+		walker->current.heaplet = NULL;
+		walker->current.previous = NULL;
+		return NULL;
+	}
+	walker->depth--;
+	walker->current = walker->stack[walker->depth];
+	walker->expanded = false;
+	walker->visited++;
+	return walker->current.heaplet;
+}
+
+/*
+ * Free the memory used by a traversal.
+ */
+static void walker_release(mr_walker_t* walker) {
+	free(walker->stack);
+	walker->stack = NULL;
+}
+
+/*
+ * Execute a crawler function on each element of a single heaplet.
+ */
+static int crawl_heaplet(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args) {
+	char* data = heaplet->data;
+	char* end_of_data = data + published_used(heaplet);
+	uint64_t items = 0;
+	int rc = 0;
+	while(rc == 0 && data < end_of_data) {
+		rc = f(*((uint64_t*) data), data + sizeof(uint64_t), extra_args);
+		items++;
+		data = next_intem_in_heaplet(data);
+	}
+	MR_COUNT(heaplet->room, crawl_items, items);
+	return rc;
+}
+
+/*
+ * Serialize a messy room in the legacy format with fill cursors by generating
+ * spans of bytes and giving them to the given callback.
+ * Return the number of char serialized.
+ */
+static size_t serialize_mr(void* arg, mr_heaplet_t* heaplet, mr_writer_function f) {
+	f(arg, MR_LEGACY_MAGIC, sizeof(uint64_t));
+	size_t ret = sizeof(uint64_t);
+	mr_walker_t walker;
+	walker_init(&walker, heaplet);
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		walker_expand(&walker);
+		char header[2 * sizeof(uint64_t)];
+		encode_64_le(header, heaplet->size);
+		encode_64_le(header + sizeof(uint64_t), heaplet->used);
+		f(arg, header, sizeof(header));
+		f(arg, heaplet->data, heaplet->size);
+		size_t neighbours_to_write = heaplet->number_of_neighbours;
+		if (walker.current.previous != NULL) {
+			neighbours_to_write--;
+		}
+		char footer[sizeof(uint64_t)];
+		encode_64_le(footer, neighbours_to_write);
+		f(arg, footer, sizeof(footer));
+		ret += sizeof(header) + heaplet->size + sizeof(footer);
+	}
+	walker_release(&walker);
+	return ret;
+}
+
+/*
+ * Compute the checksum of a buffer, as stored in the version 2 format. It is
+ * never 0. Four words are mixed in parallel to keep the multiplier busy.
+ */
+static uint64_t checksum(const char* data, size_t n) {
+	const uint64_t prime = 0x9E3779B97F4A7C15;
+	uint64_t lanes[4] = {prime ^ n, prime, 0, ~prime};
+	size_t i = 0;
+	for (; i+32 <= n; i+=32) {
+		for (unsigned int j=0; j<4; j++) {
+			lanes[j] = (lanes[j] ^ decode_64_le(data + i + 8 * j)) * prime;
+			lanes[j] ^= lanes[j] >> 31;
+		}
+	}
+	uint64_t ret = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+	for (; i<n; i++) {
+		ret = (ret ^ (unsigned char) data[i]) * prime;
+		ret ^= ret >> 31;
+	}
+	return ret == 0 ? 1 : ret;
+}
+
+/*
+ * Heaplets are compressed with a byte-oriented LZ77 in the style of LZ4. Each
+ * sequence is a token whose high and low 4 bits are the number of literals
+ * and the length of the match minus MR_LZ_MIN_MATCH, the literals, then the
+ * 2 bytes offset of the match, little-endian. Lengths of 15 go on in extra
+ * bytes which are added to them until one is not 255. The last sequence has
+ * only literals.
+ */
+#define MR_LZ_MIN_MATCH  4
+#define MR_LZ_MAX_OFFSET 65535
+#define MR_LZ_HASH_BITS  14 // At most, small inputs get smaller tables
+#define MR_LZ_SKIP_SHIFT 6 // Incompressible data is skipped faster and faster
+
+/*
+ * Write a length of a sequence past the 15 which fit in its token.
+ */
+static size_t lz_write_length(char* dest, size_t length) {
+	size_t ret = 0;
+	for (length-=15; length>=255; length-=255) {
+		dest[ret++] = (char) 255;
+	}
+	dest[ret++] = length;
+	return ret;
+}
+
+/*
+ * Write a sequence of literals followed by a match, or by nothing if
+ * match_length is 0. Return the number of bytes written, or 0 if they would
+ * not fit in capacity bytes.
+ */
+static size_t lz_write_sequence(char* dest, size_t capacity, const char* literals, size_t literals_length, size_t offset, size_t match_length) {
+	if (literals_length + literals_length / 255 + match_length / 255 + 8 > capacity) {
+		return 0;
+	}
+	size_t match_code = match_length == 0 ? 0 : match_length - MR_LZ_MIN_MATCH;
+	size_t ret = 1;
+	dest[0] = (literals_length < 15 ? literals_length : 15) << 4 | (match_code < 15 ? match_code : 15);
+	if (literals_length >= 15) {
+		ret += lz_write_length(dest + ret, literals_length);
+	}
+	memcpy(dest + ret, literals, literals_length);
+	ret += literals_length;
+	if (match_length != 0) {
+		dest[ret++] = offset & 0xFF;
+		dest[ret++] = offset >> 8;
+		if (match_code >= 15) {
+			ret += lz_write_length(dest + ret, match_code);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Compress n bytes into dest. Return the size of the compressed bytes, or 0
+ * if they would not fit in capacity bytes.
+ */
+static size_t lz_compress(const char* src, size_t n, char* dest, size_t capacity) {
+	if (n > UINT32_MAX) {
+		return 0; // Positions would not fit in the table
+	}
+	unsigned int hash_bits = 6;
+	while (hash_bits < MR_LZ_HASH_BITS && ((size_t) 1 << hash_bits) < n / 4) {
+		hash_bits++;
+	}
+	uint32_t* table = calloc((size_t) 1 << hash_bits, sizeof(uint32_t)); // Last position of each hashed word
+	size_t ret = 0;
+	size_t anchor = 0;
+	size_t i = 0;
+	while (n >= MR_LZ_MIN_MATCH && i <= n - MR_LZ_MIN_MATCH) {
+		uint32_t word;
+		uint32_t candidate_word;
+		memcpy(&word, src + i, sizeof(word));
+		uint32_t hash = (word * 2654435761u) >> (32 - hash_bits);
+		size_t candidate = table[hash];
+		table[hash] = i;
+		memcpy(&candidate_word, src + candidate, sizeof(candidate_word));
+		if (candidate >= i || i - candidate > MR_LZ_MAX_OFFSET || candidate_word != word) {
+			i += 1 + ((i - anchor) >> MR_LZ_SKIP_SHIFT);
+			continue;
+		}
+		size_t length = MR_LZ_MIN_MATCH;
+		while (i + length < n && src[candidate + length] == src[i + length]) {
+			length++;
+		}
+		size_t written = lz_write_sequence(dest + ret, capacity - ret, src + anchor, i - anchor, i - candidate, length);
+		if (written == 0) {
+			free(table);
+			return 0;
+		}
+		ret += written;
+		i += length;
+		anchor = i;
+	}
+	free(table);
+	size_t written = lz_write_sequence(dest + ret, capacity - ret, src + anchor, n - anchor, 0, 0);
+	return written == 0 ? 0 : ret + written;
+}
+
+/*
+ * Read the extra bytes of a length of a sequence. Return false if they go
+ * past the end of the compressed bytes.
+ */
+static bool lz_read_length(const unsigned char* src, size_t n, size_t* index, size_t* length) {
+	unsigned char byte;
+	do {
+		if (*index >= n) {
+			return false;
+		}
+		byte = src[*index];
+		(*index)++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+/*
+ * Decompress n bytes into exactly size bytes at dest. Return false if they
+ * are not valid compressed bytes of this size.
+ */
+static bool lz_decompress(const char* compressed, size_t n, char* dest, size_t size) {
+	const unsigned char* src = (const unsigned char*) compressed;
+	size_t index = 0;
+	size_t written = 0;
+	while (index < n) {
+		unsigned char token = src[index++];
+		size_t literals_length = token >> 4;
+		if (literals_length == 15 && !lz_read_length(src, n, &index, &literals_length)) {
+			return false;
+		}
+		if (literals_length > n - index || literals_length > size - written) {
+			return false;
+		}
+		memcpy(dest + written, src + index, literals_length);
+		index += literals_length;
+		written += literals_length;
+		if (index == n) {
+			break; // Last sequence
+		}
+		if (n - index < 2) {
+			return false;
+		}
+		size_t offset = src[index] | (size_t) src[index + 1] << 8;
+		index += 2;
+		size_t match_length = token & 15;
+		if (match_length == 15 && !lz_read_length(src, n, &index, &match_length)) {
+			return false;
+		}
+		match_length += MR_LZ_MIN_MATCH;
+		if (offset == 0 || offset > written || match_length > size - written) {
+			return false;
+		}
+		if (offset == 1) {
+			memset(dest + written, dest[written - 1], match_length);
+		} else if (offset >= match_length) {
+			memcpy(dest + written, dest + written - offset, match_length);
+		} else {
+			for (size_t i=0; i<match_length; i++) { // Overlapping match
+				dest[written + i] = dest[written + i - offset];
+			}
+		}
+		written += match_length;
+	}
+	return written == size;
+}
+
+/*
+ * Position of each part of a messy room serialized in the version 2 format.
+ */
+typedef struct {
+	size_t count;
+	mr_step_t* steps;           // Heaplets, in the order of the directory
+	uint64_t* first_neighbour;
+	uint64_t* neighbours;       // Neighbour table
+	size_t neighbours_count;
+	uint64_t* offsets;          // Offset of each heaplet's data
+	uint64_t* stored;           // Number of bytes of it which are stored
+	uint64_t* encodings;
+	const char** payloads;      // What is stored, its data or a compressed copy
+	uint64_t* filter_offsets;   // Offset of each heaplet's filter, after all the data
+	size_t total_size;
+} mr_layout_t;
+
+/*
+ * Choose how the data of an heaplet is stored given the MR_WRITE_* flags:
+ * whole, only its used bytes, or its used bytes compressed if they shrink.
+ */
+static void layout_payload(mr_layout_t* layout, size_t i, int flags) {
+	const mr_heaplet_t* heaplet = layout->steps[i].heaplet;
+	layout->stored[i] = heaplet->size;
+	layout->encodings[i] = MR_ENCODING_RAW;
+	layout->payloads[i] = heaplet->data;
+	if (!(flags & (MR_WRITE_ELIDE | MR_WRITE_COMPRESS))) {
+		return;
+	}
+	layout->stored[i] = heaplet->used;
+	if (!(flags & MR_WRITE_COMPRESS) || heaplet->used == 0) {
+		return;
+	}
+	char* compressed = malloc(heaplet->used);
+	size_t compressed_size = lz_compress(heaplet->data, heaplet->used, compressed, heaplet->used - 1);
+	if (compressed_size == 0) {
+		free(compressed);
+		return;
+	}
+	layout->stored[i] = compressed_size;
+	layout->encodings[i] = MR_ENCODING_LZ;
+	layout->payloads[i] = compressed;
+}
+
+/*
+ * Number the heaplets of a messy room in the order of a traversal from the
+ * given heaplet and compute their neighbour table and where their data goes,
+ * stored as the MR_WRITE_* flags say.
+ */
+static void layout_mr(mr_layout_t* layout, mr_heaplet_t* heaplet, int flags) {
+	size_t capacity = 64;
+	layout->count = 0;
+	layout->steps = malloc(sizeof(mr_step_t) * capacity);
+	mr_walker_t walker;
+	walker_init(&walker, heaplet);
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		walker_expand(&walker);
+		if (layout->count == capacity) {
+			capacity *= 2;
+			layout->steps = realloc(layout->steps, sizeof(mr_step_t) * capacity);
+		}
+		layout->steps[layout->count] = walker.current;
+		layout->count++;
+	}
+	walker_release(&walker);
+
+	// The first neighbour of an heaplet is the one it has been reached from,
+	// the others are visited after it, in the order they are in its list.
+	layout->first_neighbour = malloc(sizeof(uint64_t) * layout->count);
+	uint64_t* next_neighbour = calloc(layout->count, sizeof(uint64_t));
+	layout->neighbours_count = 0;
+	for (size_t i=0; i<layout->count; i++) {
+		layout->first_neighbour[i] = layout->neighbours_count;
+		layout->neighbours_count += layout->steps[i].heaplet->number_of_neighbours;
+	}
+	layout->neighbours = malloc(sizeof(uint64_t) * (layout->neighbours_count + 1));
+	for (size_t i=0; i<layout->count; i++) {
+		next_neighbour[i] = layout->first_neighbour[i];
+		if (layout->steps[i].previous_index != MR_NO_INDEX) {
+			layout->neighbours[next_neighbour[i]] = layout->steps[i].previous_index;
+			next_neighbour[i]++;
+		}
+	}
+	for (size_t i=1; i<layout->count; i++) {
+		size_t previous = layout->steps[i].previous_index;
+		layout->neighbours[next_neighbour[previous]] = i;
+		next_neighbour[previous]++;
+	}
+	free(next_neighbour);
+
+	layout->offsets = malloc(sizeof(uint64_t) * layout->count);
+	layout->stored = malloc(sizeof(uint64_t) * layout->count);
+	layout->encodings = malloc(sizeof(uint64_t) * layout->count);
+	layout->payloads = malloc(sizeof(char*) * layout->count);
+	layout->total_size = MR_V2_HEADER_BYTES + layout->count * MR_V2_ENTRY_BYTES + layout->neighbours_count * sizeof(uint64_t);
+	for (size_t i=0; i<layout->count; i++) {
+		layout_payload(layout, i, flags);
+		layout->offsets[i] = layout->total_size;
+		layout->total_size += layout->stored[i];
+	}
+	layout->filter_offsets = malloc(sizeof(uint64_t) * layout->count);
+	for (size_t i=0; i<layout->count; i++) {
+		layout->filter_offsets[i] = layout->total_size;
+		layout->total_size += state_of(layout->steps[i].heaplet)->filter_size;
+	}
+}
+
+static void free_layout(mr_layout_t* layout) {
+	for (size_t i=0; i<layout->count; i++) {
+		if (layout->payloads[i] != layout->steps[i].heaplet->data) {
+			free((char*) layout->payloads[i]);
+		}
+	}
+	free(layout->stored);
+	free(layout->encodings);
+	free(layout->payloads);
+	free(layout->steps);
+	free(layout->first_neighbour);
+	free(layout->neighbours);
+	free(layout->offsets);
+	free(layout->filter_offsets);
+}
+
+/*
+ * Serialize a messy room in the version 2 format, storing the heaplets as
+ * the MR_WRITE_* flags say. If dry_run is set, nothing is written. If base is
+ * not negative, the room remembers that it has been written at this offset of
+ * a file, for mr_sync. Return the number of char serialized.
+ */
+static size_t serialize_mr_v2(void* arg, mr_heaplet_t* heaplet, mr_writer_function f, bool dry_run, off_t base, int flags) {
+	mr_layout_t layout;
+	layout_mr(&layout, heaplet, flags);
+	size_t ret = layout.total_size;
+	if (dry_run) {
+		free_layout(&layout);
+		return ret;
+	}
+
+	char header[MR_V2_HEADER_BYTES];
+	uint64_t header_fields[MR_V2_HEADER_FIELDS] = {
+		[MR_V2_HEADER_VERSION] = MR_V2_VERSION,
+		[MR_V2_HEADER_TOTAL_SIZE] = layout.total_size,
+		[MR_V2_HEADER_HEAPLETS] = layout.count,
+		[MR_V2_HEADER_DIRECTORY] = MR_V2_HEADER_BYTES,
+		[MR_V2_HEADER_ENTRY_SIZE] = MR_V2_ENTRY_BYTES,
+		[MR_V2_HEADER_NEIGHBOURS] = MR_V2_HEADER_BYTES + layout.count * MR_V2_ENTRY_BYTES,
+		[MR_V2_HEADER_NEIGHBOURS_COUNT] = layout.neighbours_count,
+	};
+	for (unsigned int i=0; i<MR_V2_HEADER_FIELDS; i++) {
+		encode_64_le(header + i * sizeof(uint64_t), header_fields[i]);
+	}
+	memcpy(header, MR_V2_MAGIC, sizeof(uint64_t));
+	f(arg, header, sizeof(header));
+
+	char* directory = malloc(layout.count * MR_V2_ENTRY_BYTES);
+	for (size_t i=0; i<layout.count; i++) {
+		const mr_heaplet_t* current = layout.steps[i].heaplet;
+		uint64_t entry[MR_V2_ENTRY_FIELDS] = {
+			[MR_V2_ENTRY_DATA] = layout.offsets[i],
+			[MR_V2_ENTRY_HEAPLET_SIZE] = current->size,
+			[MR_V2_ENTRY_USED] = current->used,
+			[MR_V2_ENTRY_STORED] = layout.stored[i],
+			[MR_V2_ENTRY_ENCODING] = layout.encodings[i],
+			[MR_V2_ENTRY_CHECKSUM] = checksum(layout.payloads[i], layout.stored[i]),
+			[MR_V2_ENTRY_FIRST_NEIGHBOUR] = layout.first_neighbour[i],
+			[MR_V2_ENTRY_NEIGHBOURS] = current->number_of_neighbours,
+			[MR_V2_ENTRY_FILTER] = state_of(current)->filter == NULL ? 0 : layout.filter_offsets[i],
+			[MR_V2_ENTRY_FILTER_SIZE] = state_of(current)->filter_size,
+		};
+		for (unsigned int j=0; j<MR_V2_ENTRY_FIELDS; j++) {
+			encode_64_le(directory + i * MR_V2_ENTRY_BYTES + j * sizeof(uint64_t), entry[j]);
+		}
+	}
+	f(arg, directory, layout.count * MR_V2_ENTRY_BYTES);
+	free(directory);
+
+	char* neighbours = malloc(layout.neighbours_count * sizeof(uint64_t) + 1);
+	for (size_t i=0; i<layout.neighbours_count; i++) {
+		encode_64_le(neighbours + i * sizeof(uint64_t), layout.neighbours[i]);
+	}
+	f(arg, neighbours, layout.neighbours_count * sizeof(uint64_t));
+	free(neighbours);
+
+	for (size_t i=0; i<layout.count; i++) {
+		f(arg, layout.payloads[i], layout.stored[i]);
+	}
+	for (size_t i=0; i<layout.count; i++) {
+		if (state_of(layout.steps[i].heaplet)->filter != NULL) {
+			f(arg, (const char*) state_of(layout.steps[i].heaplet)->filter, state_of(layout.steps[i].heaplet)->filter_size);
+		}
+	}
+
+	mr_room_t* room = heaplet->room;
+	if (base >= 0) {
+		room->file_root = layout.steps[0].heaplet;
+		room->file_base = base;
+		room->file_size = layout.total_size;
+		room->file_heaplets = layout.count;
+		room->file_directory = MR_V2_HEADER_BYTES;
+		room->file_entry_size = MR_V2_ENTRY_BYTES;
+		room->structure_changed = false;
+		for (size_t i=0; i<layout.count; i++) {
+			layout.steps[i].heaplet->id = i;
+			bool packed = layout.stored[i] != layout.steps[i].heaplet->size || layout.encodings[i] != MR_ENCODING_RAW;
+			state_of(layout.steps[i].heaplet)->file_offset = packed ? MR_PACKED : layout.offsets[i];
+			state_of(layout.steps[i].heaplet)->dirty_end = 0;
+			state_of(layout.steps[i].heaplet)->filter_offset = state_of(layout.steps[i].heaplet)->filter == NULL ? MR_NOT_IN_FILE : layout.filter_offsets[i];
+			state_of(layout.steps[i].heaplet)->filter_dirty = false;
+		}
+		room->dirty_count = 0;
+	}
+	free_layout(&layout);
+	return ret;
+}
+
+/*
+ * Where a messy room in the version 2 format is read from: either an array or
+ * a file read at random offsets.
+ */
+typedef struct {
+	const char* array;
+	int fd;
+	off_t base;   // Offset of the messy room in the file
+	size_t size;
+	const mr_reader_limits_t* limits; // Or NULL
+} mr_source_t;
+
+/*
+ * Read n bytes at the given offset of a messy room. Return false if they are
+ * not all there.
+ */
+static bool source_read(const mr_source_t* source, uint64_t offset, char* dest, size_t n) {
+	if (offset > source->size || n > source->size - offset) {
+		return false;
+	}
+	if (source->array != NULL) {
+		memcpy(dest, source->array + offset, n);
+		return true;
+	}
+	while (n > 0) {
+		ssize_t rc = pread(source->fd, dest, n, source->base + offset);
+		if (rc <= 0) {
+			return false;
+		}
+		dest += rc;
+		offset += rc;
+		n -= rc;
+	}
+	return true;
+}
+
+/*
+ * Part of the heaplets of a messy room whose data is loaded by a thread.
+ */
+typedef struct {
+	const mr_source_t* source;
+	mr_heaplet_t** heaplets;
+	const uint64_t* entries;
+	size_t begin;
+	size_t end;
+	bool in_place;
+	bool ok;
+} mr_load_job_t;
+
+/*
+ * Load the data of the heaplets of a job and check it. When in_place is set,
+ * the data of raw heaplets stored whole is used straight from the source
+ * array, a mapped file, without being checked: that would take reading all of
+ * it, which mapping is meant to avoid. Compressed heaplets are checked before
+ * being decompressed.
+ */
+static void* load_heaplets(void* arg) {
+	mr_load_job_t* job = arg;
+	job->ok = true;
+	for (size_t i=job->begin; i<job->end; i++) {
+		mr_heaplet_t* heaplet = job->heaplets[i];
+		const uint64_t* entry = job->entries + heaplet->id * MR_V2_ENTRY_FIELDS;
+		uint64_t size = entry[MR_V2_ENTRY_HEAPLET_SIZE];
+		uint64_t stored = entry[MR_V2_ENTRY_STORED];
+		uint64_t encoding = entry[MR_V2_ENTRY_ENCODING];
+		if (encoding != MR_ENCODING_RAW && encoding != MR_ENCODING_LZ) {
+			fprintf(stderr, "[MESSY ROOM] Error, unknown heaplet encoding.\n");
+			job->ok = false;
+			return NULL;
+		}
+		free(heaplet->data);
+		heaplet->data = NULL;
+		if (job->in_place && encoding == MR_ENCODING_RAW && stored == size && size > 0) { // An empty heaplet could point at the end of the mapping
+			heaplet->data = (char*) job->source->array + entry[MR_V2_ENTRY_DATA];
+		} else {
+			heaplet->data = calloc(size, 1);
+			if (heaplet->data == NULL) {
+				fprintf(stderr, "[MESSY ROOM] Error, unable to allocate an heaplet.\n");
+				job->ok = false;
+				return NULL;
+			}
+			char* payload = encoding == MR_ENCODING_RAW ? heaplet->data : malloc(stored + 1);
+			if (!source_read(job->source, entry[MR_V2_ENTRY_DATA], payload, stored)) {
+				fprintf(stderr, "[MESSY ROOM] Error, unable to read needed char.\n");
+				job->ok = false;
+			} else if (entry[MR_V2_ENTRY_CHECKSUM] != 0 && entry[MR_V2_ENTRY_CHECKSUM] != checksum(payload, stored)) {
+				fprintf(stderr, "[MESSY ROOM] Error, corrupted heaplet.\n");
+				job->ok = false;
+			} else if (encoding == MR_ENCODING_LZ && !lz_decompress(payload, stored, heaplet->data, entry[MR_V2_ENTRY_USED])) {
+				fprintf(stderr, "[MESSY ROOM] Error, invalid compressed heaplet.\n");
+				job->ok = false;
+			}
+			if (payload != heaplet->data) {
+				free(payload);
+			}
+			if (!job->ok) {
+				return NULL;
+			}
+		}
+		heaplet->size = size;
+		heaplet->used = entry[MR_V2_ENTRY_USED];
+		if (entry[MR_V2_ENTRY_FILTER_SIZE] != 0) {
+			state_of(heaplet)->filter_size = entry[MR_V2_ENTRY_FILTER_SIZE];
+			state_of(heaplet)->filter = malloc(state_of(heaplet)->filter_size);
+			if (state_of(heaplet)->filter == NULL || !source_read(job->source, entry[MR_V2_ENTRY_FILTER], (char*) state_of(heaplet)->filter, state_of(heaplet)->filter_size)) {
+				fprintf(stderr, "[MESSY ROOM] Error, unable to read a filter.\n");
+				job->ok = false;
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Load the data of a list of heaplets, sharing the work among threads when
+ * there is enough of it. Return false in case of error.
+ */
+#define MR_BYTES_PER_LOADING_THREAD (16 * 1024 * 1024)
+static bool load_heaplets_parallel(const mr_source_t* source, mr_heaplet_t** heaplets, size_t count, const uint64_t* entries, bool in_place) {
+	uint64_t total = 0;
+	for (size_t i=0; i<count; i++) {
+		total += entries[heaplets[i]->id * MR_V2_ENTRY_FIELDS + MR_V2_ENTRY_STORED] + entries[heaplets[i]->id * MR_V2_ENTRY_FIELDS + MR_V2_ENTRY_FILTER_SIZE];
+	}
+	long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n_threads = total / MR_BYTES_PER_LOADING_THREAD + 1;
+	if (n_cpu > 0 && n_threads > (size_t) n_cpu) {
+		n_threads = n_cpu;
+	}
+	if (in_place) {
+		n_threads = 1; // Nothing is copied
+	}
+	mr_load_job_t* jobs = malloc(sizeof(mr_load_job_t) * n_threads);
+	pthread_t* threads = malloc(sizeof(pthread_t) * n_threads);
+	bool* started = calloc(n_threads, sizeof(bool));
+	size_t begin = 0;
+	uint64_t loaded = 0;
+	for (size_t j=0; j<n_threads; j++) {
+		size_t end = begin;
+		uint64_t target = total / n_threads * (j + 1);
+		while (end < count && (loaded < target || j == n_threads - 1)) {
+			loaded += entries[heaplets[end]->id * MR_V2_ENTRY_FIELDS + MR_V2_ENTRY_STORED];
+			end++;
+		}
+		jobs[j] = (mr_load_job_t) {.source = source, .heaplets = heaplets, .entries = entries, .begin = begin, .end = end, .in_place = in_place, .ok = true};
+		begin = end;
+		if (j > 0) {
+			started[j] = !pthread_create(&threads[j], NULL, load_heaplets, &jobs[j]);
+		}
+	}
+	bool ret = true;
+	for (size_t j=0; j<n_threads; j++) {
+		if (j == 0 || !started[j]) {
+			load_heaplets(&jobs[j]);
+		} else {
+			pthread_join(threads[j], NULL);
+		}
+		ret = ret && jobs[j].ok;
+	}
+	free(jobs);
+	free(threads);
+	free(started);
+	return ret;
+}
+
+/*
+ * Check the size of an heaplet and the total size of the heaplets read so far
+ * against limits, which can be NULL. Return false if they are too big.
+ */
+static bool within_limits(const mr_reader_limits_t* limits, uint64_t heaplet_size, uint64_t total_size) {
+	if (limits == NULL) {
+		return true;
+	}
+	if ((limits->max_heaplet_size != 0 && heaplet_size > limits->max_heaplet_size) ||
+			(limits->max_total_size != 0 && total_size > limits->max_total_size)) {
+		fprintf(stderr, "[MESSY ROOM] Error, heaplets too big.\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Read a messy room in the version 2 format, or the part of it reachable
+ * from the heaplet root_id without going through the neighbour it has been
+ * reached from. The heaplets are put in the given room, which is freed in
+ * case of error. The data of raw heaplets is used in place if the room maps
+ * the source.
+ */
+static mr_heaplet_t* load_mr_v2(mr_source_t* source, uint64_t root_id, mr_room_t* room) {
+	mr_heaplet_t* ret = NULL;
+	uint64_t* entries = NULL;
+	uint64_t* neighbours = NULL;
+	char* buffer = NULL;
+	mr_heaplet_t** by_id = NULL;
+	mr_heaplet_t** loaded = NULL;
+	uint64_t* parents = NULL;
+	size_t loaded_count = 0;
+
+	// Reading the header
+	char header[MR_V2_HEADER_BYTES];
+	uint64_t fields[MR_V2_HEADER_FIELDS];
+	if (!source_read(source, 0, header, sizeof(header)) || memcmp(header, MR_V2_MAGIC, sizeof(uint64_t))) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to read the header.\n");
+		goto end;
+	}
+	for (unsigned int i=0; i<MR_V2_HEADER_FIELDS; i++) {
+		fields[i] = decode_64_le(header + i * sizeof(uint64_t));
+	}
+	uint64_t count = fields[MR_V2_HEADER_HEAPLETS];
+	uint64_t entry_size = fields[MR_V2_HEADER_ENTRY_SIZE];
+	uint64_t neighbours_count = fields[MR_V2_HEADER_NEIGHBOURS_COUNT];
+	if (fields[MR_V2_HEADER_VERSION] != MR_V2_VERSION || fields[MR_V2_HEADER_TOTAL_SIZE] > source->size ||
+			entry_size < MR_V2_ENTRY_MIN_BYTES || count == 0 || root_id >= count ||
+			count > fields[MR_V2_HEADER_TOTAL_SIZE] / entry_size ||
+			neighbours_count > fields[MR_V2_HEADER_TOTAL_SIZE] / sizeof(uint64_t)) {
+		fprintf(stderr, "[MESSY ROOM] Error, invalid header.\n");
+		goto end;
+	}
+	source->size = fields[MR_V2_HEADER_TOTAL_SIZE];
+
+	if (source->limits != NULL && source->limits->max_heaplets != 0 && count > source->limits->max_heaplets) {
+		fprintf(stderr, "[MESSY ROOM] Error, too many heaplets.\n");
+		goto end;
+	}
+
+	// Reading the directory and the neighbour table
+	uint64_t heaplets_size = 0;
+	buffer = malloc(count * entry_size > neighbours_count * sizeof(uint64_t) ? count * entry_size : neighbours_count * sizeof(uint64_t) + 1);
+	if (!source_read(source, fields[MR_V2_HEADER_DIRECTORY], buffer, count * entry_size)) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to read the directory.\n");
+		goto end;
+	}
+	entries = malloc(count * MR_V2_ENTRY_BYTES);
+	for (uint64_t i=0; i<count; i++) {
+		uint64_t* entry = entries + i * MR_V2_ENTRY_FIELDS;
+		for (unsigned int j=0; j<MR_V2_ENTRY_FIELDS; j++) { // Fields added since the file has been written are 0
+			entry[j] = j < entry_size / sizeof(uint64_t) ? decode_64_le(buffer + i * entry_size + j * sizeof(uint64_t)) : 0;
+		}
+		uint64_t filter = entry[MR_V2_ENTRY_FILTER_SIZE];
+		if (entry[MR_V2_ENTRY_USED] > entry[MR_V2_ENTRY_HEAPLET_SIZE] ||
+				(filter & (filter - 1)) != 0 || entry[MR_V2_ENTRY_FILTER] > source->size || filter > source->size - entry[MR_V2_ENTRY_FILTER] ||
+				entry[MR_V2_ENTRY_STORED] > entry[MR_V2_ENTRY_HEAPLET_SIZE] ||
+				entry[MR_V2_ENTRY_DATA] > source->size || entry[MR_V2_ENTRY_STORED] > source->size - entry[MR_V2_ENTRY_DATA] ||
+				entry[MR_V2_ENTRY_FIRST_NEIGHBOUR] > neighbours_count ||
+				entry[MR_V2_ENTRY_NEIGHBOURS] > neighbours_count - entry[MR_V2_ENTRY_FIRST_NEIGHBOUR]) {
+			fprintf(stderr, "[MESSY ROOM] Error, invalid directory entry.\n");
+			goto end;
+		}
+		heaplets_size = heaplets_size + entry[MR_V2_ENTRY_HEAPLET_SIZE] < heaplets_size ? UINT64_MAX : heaplets_size + entry[MR_V2_ENTRY_HEAPLET_SIZE];
+		if (!within_limits(source->limits, entry[MR_V2_ENTRY_HEAPLET_SIZE], heaplets_size)) {
+			goto end;
+		}
+	}
+	if (!source_read(source, fields[MR_V2_HEADER_NEIGHBOURS], buffer, neighbours_count * sizeof(uint64_t))) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to read the neighbour table.\n");
+		goto end;
+	}
+	neighbours = malloc(sizeof(uint64_t) * (neighbours_count + 1));
+	for (uint64_t i=0; i<neighbours_count; i++) {
+		neighbours[i] = decode_64_le(buffer + i * sizeof(uint64_t));
+	}
+
+	// Building the graph of heaplets
+	by_id = calloc(count, sizeof(mr_heaplet_t*));
+	loaded = malloc(sizeof(mr_heaplet_t*) * count);
+	parents = malloc(sizeof(uint64_t) * count);
+	by_id[root_id] = new_first_heaplet(room, 0);
+	by_id[root_id]->id = root_id;
+	parents[root_id] = UINT64_MAX;
+	loaded[loaded_count++] = by_id[root_id];
+	for (size_t next=0; next<loaded_count; next++) {
+		mr_heaplet_t* heaplet = loaded[next];
+		const uint64_t* entry = entries + heaplet->id * MR_V2_ENTRY_FIELDS;
+		reserve_neighbours(heaplet, entry[MR_V2_ENTRY_NEIGHBOURS] + 1);
+		for (uint64_t i=0; i<entry[MR_V2_ENTRY_NEIGHBOURS]; i++) {
+			uint64_t id = neighbours[entry[MR_V2_ENTRY_FIRST_NEIGHBOUR] + i];
+			if (heaplet->id == root_id && root_id != 0 && i == 0) {
+				continue; // Not part of the subtree
+			}
+			if (id >= count || (id != parents[heaplet->id] && by_id[id] != NULL)) {
+				fprintf(stderr, "[MESSY ROOM] Error, invalid neighbour.\n");
+				goto end;
+			}
+			if (by_id[id] == NULL) {
+				by_id[id] = new_first_heaplet(room, 0);
+				by_id[id]->id = id;
+				parents[id] = heaplet->id;
+				loaded[loaded_count++] = by_id[id];
+			}
+			heaplet->neighbours[heaplet->number_of_neighbours] = by_id[id];
+			heaplet->number_of_neighbours++;
+		}
+	}
+
+	// Reading the data
+	if (load_heaplets_parallel(source, loaded, loaded_count, entries, room->mapping != NULL && room->mapping == source->array)) {
+		ret = by_id[root_id];
+		if (root_id == 0) { // Remember where everything is for mr_sync
+			room->file_root = ret;
+			room->file_base = source->base;
+			room->file_size = fields[MR_V2_HEADER_TOTAL_SIZE];
+			room->file_heaplets = count;
+			room->file_directory = fields[MR_V2_HEADER_DIRECTORY];
+			room->file_entry_size = entry_size;
+			for (size_t i=0; i<loaded_count; i++) {
+				const uint64_t* entry = entries + loaded[i]->id * MR_V2_ENTRY_FIELDS;
+				bool packed = entry[MR_V2_ENTRY_STORED] != entry[MR_V2_ENTRY_HEAPLET_SIZE] || entry[MR_V2_ENTRY_ENCODING] != MR_ENCODING_RAW;
+				state_of(loaded[i])->file_offset = packed ? MR_PACKED : entry[MR_V2_ENTRY_DATA];
+				if (state_of(loaded[i])->filter != NULL) {
+					state_of(loaded[i])->filter_offset = entry[MR_V2_ENTRY_FILTER];
+				}
+			}
+		}
+	}
+
+end:
+	if (ret == NULL) {
+		for (size_t i=0; i<loaded_count; i++) {
+			if (!is_mapped(loaded[i])) {
+				free(loaded[i]->data);
+			}
+			free(state_of(loaded[i])->filter);
+			free(loaded[i]->neighbours);
+			free(loaded[i]);
+		}
+		free_room(room);
+	}
+	free(buffer);
+	free(entries);
+	free(neighbours);
+	free(by_id);
+	free(loaded);
+	free(parents);
+	return ret;
+}
+
+/*
+ * Create a new empty heaplet with no neighbour.
+ */
+mr_heaplet_t* mr_new(void) {
+	return new_heaplet(0, NULL);
+}
+
+/*
+ * Create a new empty messy room whose first heaplet can hold capacity bytes,
+ * counting the size of each element.
+ */
+mr_heaplet_t* mr_new_with_capacity(size_t capacity) {
+	return new_heaplet(capacity, NULL);
+}
+
+/*
+ * Create a new empty messy room whose heaplets, their data and their lists of
+ * neighbours are carved out of large chunks of memory. The first chunk can
+ * hold size_hint bytes. Freeing the room only frees the chunks.
+ */
+mr_heaplet_t* mr_new_in_arena(size_t size_hint) {
+	mr_room_t* room = new_room();
+	new_chunk(room, size_hint);
+	return new_first_heaplet(room, 0);
+}
+
+/*
+ * Free a heaplet and all its neighbours.
+ */
+void mr_free(mr_heaplet_t* heaplet) {
+	mr_room_t* room = heaplet->room;
+	if (room->arena != NULL) { // Everything is in the arena
+		free_room(room);
+		return;
+	}
+	mr_walker_t walker;
+	walker_init(&walker, heaplet);
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		walker_expand(&walker);
+		if (!is_mapped(heaplet)) {
+			free(heaplet->data);
+		}
+		free(state_of(heaplet)->filter);
+		free(heaplet->neighbours);
+		free(heaplet);
+	}
+	walker_release(&walker);
+	free_room(room);
+}
+
+/*
+ * Find an heaplet with room for needed bytes in the messy room of an heaplet,
+ * according to its placement policy, see mr_add_data. If a new heaplet has
+ * to be made, it is made big enough for wanted bytes, if the sizing policy
+ * allows it.
+ */
+static mr_heaplet_t* find_room(mr_heaplet_t* heaplet, size_t needed, size_t wanted) {
+	mr_room_t* room = heaplet->room;
+	mr_heaplet_t* candidate = NULL;
+	uint64_t hops = 0; // Heaplets moved to from the one given
+	switch (room->placement) {
+		case MR_PLACE_BOUNDED_PROBE:
+			for (int i=0; i<MR_PROBE_LIMIT && needed > empty_space(heaplet) && heaplet->number_of_neighbours > 0; i++) {
+				heaplet = heaplet->neighbours[room_random(room) % heaplet->number_of_neighbours];
+				hops++;
+			}
+			break;
+		case MR_PLACE_FIRST_FIT:
+			candidate = free_list_first_fit(room, needed);
+			break;
+		case MR_PLACE_LAST_WITH_ROOM:
+			candidate = room->last_with_room;
+			break;
+		default:
+			break;
+	}
+	if (candidate != NULL && needed <= empty_space(candidate)) {
+		heaplet = candidate;
+	} else if (room->placement != MR_PLACE_RANDOM_WALK && room->placement != MR_PLACE_BOUNDED_PROBE && room->last_made != NULL) {
+		heaplet = room->last_made; // The new heaplet will grow from the last one
+	}
+	while (needed > empty_space(heaplet)) {
+		mr_heaplet_t* next_heaplet = room->placement == MR_PLACE_RANDOM_WALK ? choose_next_heaplet(heaplet) : NULL;
+		if (next_heaplet == NULL) {
+			next_heaplet = new_heaplet(next_heaplet_size(heaplet, needed, wanted), heaplet);
+			new_neighbour(heaplet, next_heaplet);
+			room->last_made = next_heaplet;
+			MR_COUNT(room, heaplets_made, 1);
+			if (room->placement == MR_PLACE_FIRST_FIT) {
+				free_list_push(next_heaplet);
+			}
+		}
+		heaplet = next_heaplet;
+		hops++;
+	}
+	MR_COUNT(room, add_hops, hops);
+	return heaplet;
+}
+
+/*
+ * Put data in the heaplet find_room chooses for it. Return that heaplet.
+ */
+static mr_heaplet_t* place_data(mr_heaplet_t* heaplet, size_t size, const void* data) {
+	mr_room_t* room = heaplet->room;
+	heaplet = find_room(heaplet, size + sizeof(uint64_t), size + sizeof(uint64_t));
+	add_data(heaplet, size, data);
+	MR_COUNT(room, add_calls, 1);
+	if (room->placement == MR_PLACE_LAST_WITH_ROOM) {
+		room->last_with_room = heaplet;
+	}
+	return heaplet;
+}
+
+/*
+ * Add data into a heaplet. If there is not enought space, a neighbour or a new
+ * heaplet will be chosen according to the placement policy of the room. The
+ * heaplet choosen is returned.
+ */
+mr_heaplet_t* mr_add_data(mr_heaplet_t* heaplet, size_t size, const void* data) {
+	heaplet = place_data(heaplet, size, data);
+	drop_filter(heaplet); // It would not account for the element
+	return heaplet;
+}
+
+/*
+ * Same as mr_add_data, also adding the key, usually a part of the element, to
+ * the Bloom filter of the heaplet it is put in so that mr_find_keyed can skip
+ * the heaplets which do not hold it. Only heaplets whose first element has
+ * been added with a key get a filter.
+ */
+mr_heaplet_t* mr_add_keyed(mr_heaplet_t* heaplet, const void* key, size_t key_size, size_t size, const void* data) {
+	heaplet = place_data(heaplet, size, data);
+	if (state_of(heaplet)->filter == NULL && heaplet->used == sizeof(uint64_t) + size) {
+		ensure_filter(heaplet);
+	}
+	if (state_of(heaplet)->filter != NULL) {
+		filter_bits(state_of(heaplet)->filter, state_of(heaplet)->filter_size, checksum(key, key_size), true);
+		state_of(heaplet)->filter_dirty = state_of(heaplet)->filter_offset != MR_NOT_IN_FILE;
+	}
+	return heaplet;
+}
+
+/*
+ * Size and data of the element i of a batch: either items[i] or the element
+ * i of n contiguous elements of the same size at data if items is NULL.
+ */
+static size_t batch_item(const struct iovec* items, size_t size, const char* data, size_t i, const char** item) {
+	if (items == NULL) {
+		*item = data + i * size;
+		return size;
+	}
+	*item = items[i].iov_base;
+	return items[i].iov_len;
+}
+
+/*
+ * Add the elements of a batch from begin to end, which fit in the empty space
+ * of an heaplet, one after the other.
+ */
+static void add_batch_items(mr_heaplet_t* heaplet, const struct iovec* items, size_t size, const char* data, size_t begin, size_t end) {
+	char* target = goto_empty_space(heaplet);
+	for (size_t i=begin; i<end; i++) {
+		const char* item;
+		size_t item_size = batch_item(items, size, data, i, &item);
+		*((uint64_t*) target) = item_size;
+		memcpy(target + sizeof(uint64_t), item, item_size);
+		target += sizeof(uint64_t) + item_size;
+	}
+	size_t added = target - (heaplet->data + heaplet->used);
+	mark_dirty(heaplet, heaplet->used, heaplet->used + added);
+	heaplet->used += added;
+	heaplet->reserved = heaplet->used;
+	state_of(heaplet)->last_reserved = MR_NOT_RESERVED;
+	write_mapped_fill_cursor(heaplet);
+	drop_filter(heaplet);
+}
+
+/*
+ * Add n elements, either given by items or of size bytes each at data. The
+ * heaplet with room for the first element is chosen by the placement policy
+ * and filled with as many elements as it can hold. The elements left go into
+ * new heaplets made big enough for all of them, as far as the sizing policy
+ * allows. The first max_used heaplets used are put in used and their number
+ * in used_count. Return the heaplet the last element has been put in.
+ */
+static mr_heaplet_t* add_batch(mr_heaplet_t* heaplet, const struct iovec* items, size_t size, const char* data, size_t n, mr_heaplet_t** used, size_t max_used, size_t* used_count) {
+	mr_room_t* room = heaplet->room;
+	const char* item;
+	size_t left = 0; // Bytes needed by the elements not added yet
+	for (size_t i=0; i<n; i++) {
+		left += sizeof(uint64_t) + batch_item(items, size, data, i, &item);
+	}
+	*used_count = 0;
+	size_t begin = 0;
+	while (begin < n) {
+		size_t needed = sizeof(uint64_t) + batch_item(items, size, data, begin, &item);
+		if (*used_count == 0) {
+			heaplet = find_room(heaplet, needed, left);
+		} else {
+			mr_heaplet_t* next_heaplet = new_heaplet(next_heaplet_size(heaplet, needed, left), heaplet);
+			new_neighbour(heaplet, next_heaplet);
+			room->last_made = next_heaplet;
+			MR_COUNT(room, heaplets_made, 1);
+			if (room->placement == MR_PLACE_FIRST_FIT) {
+				free_list_push(next_heaplet);
+			}
+			heaplet = next_heaplet;
+		}
+		size_t added = needed;
+		size_t end = begin + 1;
+		while (end < n && (needed = sizeof(uint64_t) + batch_item(items, size, data, end, &item)) <= empty_space(heaplet) - added) {
+			added += needed;
+			end++;
+		}
+		add_batch_items(heaplet, items, size, data, begin, end);
+		MR_COUNT(room, add_calls, end - begin);
+		if (*used_count < max_used) {
+			used[*used_count] = heaplet;
+		}
+		(*used_count)++;
+		left -= added;
+		begin = end;
+	}
+	if (room->placement == MR_PLACE_LAST_WITH_ROOM && n > 0) {
+		room->last_with_room = heaplet;
+	}
+	return heaplet;
+}
+
+/*
+ * Add n elements given as an array of iovec in one go, as few heaplets being
+ * looked at or made as possible. Return the heaplet the last one has been put
+ * in, or the given one if n is 0.
+ */
+mr_heaplet_t* mr_add_datav(mr_heaplet_t* heaplet, const struct iovec* items, size_t n) {
+	size_t used_count;
+	return add_batch(heaplet, items, 0, NULL, n, NULL, 0, &used_count);
+}
+
+/*
+ * Add n elements of size bytes each, one after the other at data, such as
+ * records loaded from a file, as mr_add_datav does. The first max_used
+ * heaplets they have been put in are stored in used, in order. Return the
+ * number of heaplets used.
+ */
+size_t mr_add_bulk(mr_heaplet_t* heaplet, uint64_t size, const void* data, size_t n, mr_heaplet_t** used, size_t max_used) {
+	size_t used_count;
+	add_batch(heaplet, NULL, size, data, n, used, max_used, &used_count);
+	return used_count;
+}
+
+/*
+ * Add an element of size bytes without copying it: return where its bytes,
+ * all 0, are in the heaplet chosen as by mr_add_data, for the caller to build
+ * the element there. The heaplet is put in used if it is not NULL. Until an
+ * other element is added to that heaplet, the element can be shrunk with
+ * mr_commit or removed with mr_abort.
+ */
+char* mr_reserve(mr_heaplet_t* heaplet, size_t size, mr_heaplet_t** used) {
+	heaplet = place_data(heaplet, size, NULL);
+	drop_filter(heaplet);
+	if (used != NULL) {
+		*used = heaplet;
+	}
+	state_of(heaplet)->last_reserved = heaplet->used - size;
+	return heaplet->data + heaplet->used - size;
+}
+
+/*
+ * Make the element reserved at data, which is the last one of an heaplet,
+ * end at end, cleaning the bytes it no longer uses. Return false if it is not
+ * the element made by the last mr_reserve in the heaplet, if elements have
+ * been added after it, including by mr_add_data_concurrent which doesn't
+ * keep track of reservations, or if it would grow.
+ */
+static bool truncate_reserved(mr_heaplet_t* heaplet, char* data, size_t end) {
+	size_t offset = state_of(heaplet)->last_reserved;
+	if (offset == MR_NOT_RESERVED || data != heaplet->data + offset ||
+			offset + decode_64_le(data - sizeof(uint64_t)) != heaplet->used || end > heaplet->used) {
+		fprintf(stderr, "[MESSY ROOM] Error, the element is not the last one reserved in the heaplet.\n");
+		return false;
+	}
+	size_t header = data - sizeof(uint64_t) - heaplet->data;
+	memset(heaplet->data + end, 0, heaplet->used - end);
+	mark_dirty(heaplet, header, heaplet->used);
+	heaplet->used = end;
+	heaplet->reserved = end;
+	write_mapped_fill_cursor(heaplet);
+	return true;
+}
+
+/*
+ * Shrink an element reserved with mr_reserve in an heaplet to the size bytes
+ * the caller has actually written, such as what read() returned. Return false
+ * if it is bigger or the element is no longer the last one of the heaplet.
+ */
+bool mr_commit(mr_heaplet_t* heaplet, char* data, size_t size) {
+	if (!truncate_reserved(heaplet, data, data - heaplet->data + size)) {
+		return false;
+	}
+	*((uint64_t*) (data - sizeof(uint64_t))) = size;
+	return true;
+}
+
+/*
+ * Remove an element reserved with mr_reserve in an heaplet. Return false if
+ * it is no longer the last element of the heaplet.
+ */
+bool mr_abort(mr_heaplet_t* heaplet, char* data) {
+	if (!truncate_reserved(heaplet, data, data - sizeof(uint64_t) - heaplet->data)) {
+		return false;
+	}
+	state_of(heaplet)->last_reserved = MR_NOT_RESERVED;
+	return true;
+}
+
+/*
+ * Heaplet a thread adds data to concurrently in a given room.
+ */
+typedef struct {
+	uint64_t room_serial;
+	mr_heaplet_t* heaplet;
+} mr_home_t;
+
+static _Thread_local mr_home_t homes[MR_HOMES];
+static _Thread_local unsigned int next_home = 0;
+
+/*
+ * Add a neighbour to an heaplet while other threads might read its list of
+ * neighbours. A replaced list is kept until the room is freed. The room's lock
+ * must be held.
+ */
+static void publish_neighbour(mr_heaplet_t* heaplet, mr_heaplet_t* neighbour) {
+	mr_room_t* room = heaplet->room;
+	room->structure_changed = true;
+	if (heaplet->number_of_neighbours == heaplet->neighbours_capacity) {
+		size_t capacity = heaplet->neighbours_capacity < 2 ? 4 : heaplet->neighbours_capacity * 2;
+		mr_heaplet_t** new_buffer = room_alloc(room, sizeof(mr_heaplet_t*) * capacity);
+		if (heaplet->number_of_neighbours > 0) {
+			memcpy(new_buffer, heaplet->neighbours, sizeof(mr_heaplet_t*) * heaplet->number_of_neighbours);
+		}
+		if (room->arena == NULL && heaplet->neighbours != NULL) {
+			if (room->retired_count == room->retired_capacity) {
+				room->retired_capacity = room->retired_capacity < 8 ? 16 : room->retired_capacity * 2;
+				room->retired = realloc(room->retired, sizeof(void*) * room->retired_capacity);
+			}
+			room->retired[room->retired_count] = heaplet->neighbours;
+			room->retired_count++;
+		}
+		__atomic_store_n(&heaplet->neighbours, new_buffer, __ATOMIC_RELEASE);
+		heaplet->neighbours_capacity = capacity;
+	}
+	heaplet->neighbours[heaplet->number_of_neighbours] = neighbour;
+	__atomic_store_n(&heaplet->number_of_neighbours, heaplet->number_of_neighbours + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give the heaplet the current thread adds data to in a room, or NULL if it
+ * has none yet.
+ */
+static mr_home_t* find_home(const mr_room_t* room) {
+	for (unsigned int i=0; i<MR_HOMES; i++) {
+		if (homes[i].room_serial == room->serial) {
+			return &homes[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add data into a messy room while other threads might do the same or crawl
+ * it. Each thread fills its own heaplet, which is made as a neighbour of the
+ * given heaplet the first time and then as a neighbour of the previous one
+ * when it is full. Space is claimed on the reserved cursor of the heaplet and
+ * the fill cursor is raised in the same order once the element is written,
+ * so readers only ever see complete elements. The heaplet choosen is
+ * returned.
+ */
+mr_heaplet_t* mr_add_data_concurrent(mr_heaplet_t* heaplet, size_t size, const void* data) {
+	mr_room_t* room = heaplet->room;
+	size_t needed = size + sizeof(uint64_t);
+	mr_home_t* home = find_home(room);
+	if (home == NULL) {
+		home = &homes[next_home];
+		next_home = (next_home + 1) % MR_HOMES;
+		home->room_serial = room->serial;
+		home->heaplet = NULL;
+	}
+	mr_heaplet_t* target = home->heaplet;
+	size_t offset = 0;
+	while (target == NULL || target->size < needed || (offset = __atomic_fetch_add(&target->reserved, needed, __ATOMIC_RELAXED)) > target->size - needed) {
+		mr_heaplet_t* parent = target == NULL ? heaplet : target;
+		pthread_mutex_lock(&room->lock);
+		target = new_first_heaplet(room, next_heaplet_size(parent, needed, needed));
+		target->number_of_neighbours = 1;
+		target->neighbours_capacity = 1;
+		target->neighbours = room_alloc(room, sizeof(mr_heaplet_t*));
+		target->neighbours[0] = parent;
+		publish_neighbour(parent, target);
+		pthread_mutex_unlock(&room->lock);
+		home->heaplet = target;
+		MR_COUNT(room, heaplets_made, 1);
+	}
+	char* destination = target->data + offset;
+	*((uint64_t*) destination) = size;
+	memmove(destination + sizeof(uint64_t), data, size);
+	while (__atomic_load_n(&target->used, __ATOMIC_ACQUIRE) != offset) { // Elements before are still being written
+		sched_yield();
+	}
+	if (state_of(target)->file_offset != MR_NOT_IN_FILE) {
+		pthread_mutex_lock(&room->lock);
+		mark_dirty(target, offset, offset + needed);
+		pthread_mutex_unlock(&room->lock);
+	}
+	__atomic_store_n(&target->used, offset + needed, __ATOMIC_RELEASE);
+	MR_COUNT(room, add_calls, 1);
+	return target;
+}
+
+/*
+ * Choose how mr_add_data finds room for new elements in a messy room.
+ */
+void mr_set_placement(mr_heaplet_t* heaplet, int policy) {
+	mr_room_t* room = heaplet->room;
+	room->placement = policy;
+	room->free_list_size = 0;
+	room->last_with_room = NULL;
+	if (policy == MR_PLACE_FIRST_FIT) {
+		mr_walker_t walker;
+		walker_init(&walker, heaplet);
+		while ((heaplet = walker_next(&walker)) != NULL) {
+			walker_expand(&walker);
+			free_list_push(heaplet);
+		}
+		walker_release(&walker);
+	}
+}
+
+/*
+ * Choose the size of the heaplets mr_add_data makes in a messy room. A growth
+ * of 0 is taken as 1.
+ */
+void mr_set_sizing(mr_heaplet_t* heaplet, const mr_sizing_t* sizing) {
+	mr_room_t* room = heaplet->room;
+	room->sizing = *sizing;
+	if (room->sizing.growth == 0) {
+		room->sizing.growth = 1;
+	}
+}
+
+/*
+ * Seed the pseudo random generator used to place elements in a messy room.
+ */
+void mr_set_seed(mr_heaplet_t* heaplet, uint64_t seed) {
+	// A xorshift generator must not be seeded with 0
+	heaplet->room->random_state = seed == 0 ? MR_DEFAULT_SEED : seed;
+}
+
+#define MR_COMPACT_FANOUT 16 // Neighbours of each heaplet of a compacted room, besides its parent
+
+/*
+ * State of the copy of a messy room into a new, dense one.
+ */
+struct mr_compaction_s {
+	mr_walker_t walker;  // Over the heaplets of the old room
+	mr_heaplet_t* source; // Heaplet being copied, NULL to take the next one
+	size_t source_offset; // Of its next element
+	size_t remaining;     // Bytes of the old room not looked at yet
+	mr_filter_function keep;
+	void* extra_args;
+	mr_room_t* room;      // The new room
+	mr_heaplet_t** heaplets; // Of the new room, in the order they are made
+	size_t number_of_heaplets;
+	size_t heaplets_capacity;
+	mr_heaplet_t* filtered;   // Last heaplet the filter of source has been merged into
+	mr_heaplet_t* unfiltered; // Last heaplet with elements its filter could not account for
+};
+
+/*
+ * Start copying the elements of the messy room of heaplet into a new one.
+ * Elements for which keep, if not NULL, returns false are left out. The new
+ * room has the placement and sizing policies of the old one, and its heaplets
+ * are made as big as the sizing policy lets them, to hold what is left to
+ * copy. They form a tree of MR_COMPACT_FANOUT neighbours per heaplet, filled
+ * breadth-first. The old room must not change until mr_compact_end.
+ */
+mr_compaction_t* mr_compact_begin(mr_heaplet_t* heaplet, mr_filter_function keep, void* extra_args) {
+	mr_compaction_t* compaction = malloc(sizeof(mr_compaction_t));
+	compaction->source = NULL;
+	compaction->source_offset = 0;
+	compaction->remaining = 0;
+	compaction->keep = keep;
+	compaction->extra_args = extra_args;
+	compaction->heaplets = NULL;
+	compaction->number_of_heaplets = 0;
+	compaction->heaplets_capacity = 0;
+	compaction->filtered = NULL;
+	compaction->unfiltered = NULL;
+	walker_init(&compaction->walker, heaplet);
+	mr_heaplet_t* old_heaplet;
+	while ((old_heaplet = walker_next(&compaction->walker)) != NULL) {
+		compaction->remaining += published_used(old_heaplet);
+	}
+	walker_release(&compaction->walker);
+	walker_init(&compaction->walker, heaplet);
+
+	mr_room_t* old_room = heaplet->room;
+	mr_room_t* room = new_room();
+	room->placement = old_room->placement;
+	room->random_state = old_room->random_state;
+	room->sizing = old_room->sizing;
+	if (old_room->arena != NULL) {
+		new_chunk(room, compaction->remaining);
+	}
+	compaction->room = room;
+	return compaction;
+}
+
+/*
+ * Copy an element at the end of the new room of a compaction. A new heaplet
+ * is made if it does not fit in the last one. The filter of the heaplet it
+ * comes from is folded into the filter of the one it goes to. Keys can't be
+ * spread over a bigger filter, so if it is smaller or missing, the heaplet it
+ * goes to is left without a filter and searched whole by mr_find_keyed.
+ */
+static void compaction_add(mr_compaction_t* compaction, uint64_t size, const char* data) {
+	size_t needed = sizeof(uint64_t) + size;
+	mr_heaplet_t* last = compaction->number_of_heaplets == 0 ? NULL : compaction->heaplets[compaction->number_of_heaplets - 1];
+	if (last == NULL || empty_space(last) < needed) {
+		mr_heaplet_t* heaplet = new_first_heaplet(compaction->room, clamp_heaplet_size(&compaction->room->sizing, compaction->remaining, needed));
+		if (last != NULL) {
+			mr_heaplet_t* parent = compaction->heaplets[(compaction->number_of_heaplets - 1) / MR_COMPACT_FANOUT];
+			reserve_neighbours(heaplet, 1);
+			heaplet->number_of_neighbours = 1;
+			heaplet->neighbours[0] = parent;
+			new_neighbour(parent, heaplet);
+		}
+		if (compaction->number_of_heaplets == compaction->heaplets_capacity) {
+			compaction->heaplets_capacity = compaction->heaplets_capacity == 0 ? 16 : compaction->heaplets_capacity * 2;
+			compaction->heaplets = realloc(compaction->heaplets, sizeof(mr_heaplet_t*) * compaction->heaplets_capacity);
+		}
+		compaction->heaplets[compaction->number_of_heaplets] = heaplet;
+		compaction->number_of_heaplets++;
+		last = heaplet;
+	}
+	add_data(last, size, data);
+	const mr_heaplet_t* source = compaction->source;
+	if (compaction->unfiltered == last || compaction->filtered == last) {
+		return;
+	}
+	if (state_of(source)->filter == NULL || state_of(source)->filter_size < filter_size(last->size)) {
+		drop_filter(last);
+		compaction->unfiltered = last;
+		return;
+	}
+	ensure_filter(last); // Elements already in it came from heaplets with filters
+	merge_filter(state_of(last)->filter, state_of(last)->filter_size, state_of(source)->filter, state_of(source)->filter_size);
+	compaction->filtered = last;
+}
+
+/*
+ * Go on with a compaction until about budget bytes of the old room have been
+ * looked at. Return true once all of it has been copied.
+ */
+bool mr_compact_step(mr_compaction_t* compaction, size_t budget) {
+	size_t done = 0;
+	while (done < budget) {
+		if (compaction->source == NULL) {
+			compaction->source = walker_next(&compaction->walker);
+			if (compaction->source == NULL) {
+				return true;
+			}
+			walker_expand(&compaction->walker);
+			compaction->source_offset = 0;
+			compaction->filtered = NULL;
+		}
+		if (compaction->source_offset >= published_used(compaction->source)) {
+			compaction->source = NULL;
+			continue;
+		}
+		char* item = compaction->source->data + compaction->source_offset;
+		uint64_t size = *((uint64_t*) item);
+		if (compaction->keep == NULL || compaction->keep(size, item + sizeof(uint64_t), compaction->extra_args)) {
+			compaction_add(compaction, size, item + sizeof(uint64_t));
+		}
+		compaction->source_offset += sizeof(uint64_t) + size;
+		compaction->remaining -= sizeof(uint64_t) + size;
+		done += sizeof(uint64_t) + size;
+	}
+	return false;
+}
+
+/*
+ * Finish a compaction and return the first heaplet of the new messy room. The
+ * old one is left as it is.
+ */
+mr_heaplet_t* mr_compact_end(mr_compaction_t* compaction) {
+	while (!mr_compact_step(compaction, SIZE_MAX));
+	walker_release(&compaction->walker);
+	mr_room_t* room = compaction->room;
+	mr_heaplet_t* ret;
+	if (compaction->number_of_heaplets == 0) {
+		ret = new_first_heaplet(room, 0);
+	} else {
+		ret = compaction->heaplets[0];
+		mr_heaplet_t* last = compaction->heaplets[compaction->number_of_heaplets - 1];
+		size_t size = clamp_heaplet_size(&room->sizing, last->used, last->used);
+		if (room->arena == NULL && size < last->size) { // It was made for elements which have been left out
+			last->data = realloc(last->data, size);
+			last->size = size;
+		}
+		mr_set_placement(ret, room->placement);
+		room->last_made = last;
+		if (room->placement == MR_PLACE_LAST_WITH_ROOM) {
+			room->last_with_room = room->last_made;
+		}
+	}
+	free(compaction->heaplets);
+	free(compaction);
+	return ret;
+}
+
+/*
+ * Copy the elements of a messy room for which keep, if not NULL, returns true
+ * into a new, dense one and return its first heaplet. See mr_compact_begin.
+ */
+mr_heaplet_t* mr_compact(mr_heaplet_t* heaplet, mr_filter_function keep, void* extra_args) {
+	return mr_compact_end(mr_compact_begin(heaplet, keep, extra_args));
+}
+
+/*
+ * Index of the bucket of a histogram of sizes: 0 for 0 and i for sizes in
+ * [2^(i-1), 2^i), the last bucket taking the bigger ones.
+ */
+static size_t size_bucket(uint64_t size) {
+	size_t ret = size == 0 ? 0 : 64 - __builtin_clzll(size);
+	return ret < MR_SIZE_BUCKETS ? ret : MR_SIZE_BUCKETS - 1;
+}
+
+/*
+ * Describe the messy room of heaplet: its heaplets, their elements and how
+ * they are linked, as seen from heaplet. The depth is that of the traversal
+ * tree rooted at heaplet. The room must not change meanwhile.
+ */
+void mr_stats(mr_heaplet_t* heaplet, mr_stats_t* stats) {
+	memset(stats, 0, sizeof(mr_stats_t));
+	mr_room_t* room = heaplet->room;
+	size_t* depths = NULL; // Of the heaplets, in the order they are visited
+	size_t depths_capacity = 0;
+	mr_walker_t walker;
+	walker_init(&walker, heaplet);
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		size_t index = walker.visited - 1;
+		if (index == depths_capacity) {
+			depths_capacity = depths_capacity == 0 ? 64 : depths_capacity * 2;
+			depths = realloc(depths, sizeof(size_t) * depths_capacity);
+		}
+		depths[index] = walker.current.previous_index == MR_NO_INDEX ? 0 : depths[walker.current.previous_index] + 1;
+		if (depths[index] > stats->depth) {
+			stats->depth = depths[index];
+		}
+		walker_expand(&walker);
+
+		size_t used = published_used(heaplet);
+		stats->heaplets++;
+		stats->total_bytes += heaplet->size;
+		stats->used_bytes += used;
+		stats->fill[heaplet->size == 0 ? MR_FILL_BUCKETS - 1 : used * (MR_FILL_BUCKETS - 1) / heaplet->size]++;
+		size_t degree = heaplet->number_of_neighbours;
+		stats->degrees[degree < MR_DEGREE_BUCKETS ? degree : MR_DEGREE_BUCKETS - 1]++;
+		if (degree > stats->max_degree) {
+			stats->max_degree = degree;
+		}
+		for (char* data = heaplet->data; data < heaplet->data + used; data = next_intem_in_heaplet(data)) {
+			stats->elements++;
+			stats->element_sizes[size_bucket(*((uint64_t*) data))]++;
+		}
+	}
+	walker_release(&walker);
+	free(depths);
+#ifdef MR_STATS_COUNTERS
+	stats->counting = true;
+	uint64_t* counters = (uint64_t*) &room->counters;
+	for (size_t i=0; i<sizeof(mr_counters_t) / sizeof(uint64_t); i++) {
+		((uint64_t*) &stats->counters)[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	}
+#else
+	(void) room;
+#endif
+}
+
+
+/*
+ * Execute a function on each element of the messy room. The function takes the
+ * size and the content of each element and an extra pointer that can be used
+ * to give arguments to the function.
+ * If the function f returns 0, the next element is searched throught,
+ * otherwize, mr_crawl returns the exit code of the function f.
+ * If all function calls on all elements in the messy room have returned 0,
+ * mr_crawl returns 0.
+ */
+int mr_crawl(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args) {
+	int rc = 0;
+	MR_COUNT(heaplet->room, crawls, 1);
+	mr_walker_t walker;
+	walker_init(&walker, heaplet);
+	while (rc == 0 && (heaplet = walker_next(&walker)) != NULL) {
+		walker_expand(&walker);
+		rc = crawl_heaplet(heaplet, f, extra_args);
+	}
+	walker_release(&walker);
+	return rc;
+}
+
+/*
+ * Index of the worker running the current parallel crawl, 0 outside of them.
+ */
+static _Thread_local unsigned int crawl_thread_id = 0;
+
+/*
+ * Heaplets scheduled for a worker of a parallel crawl. The owner pushes and
+ * pops at the bottom while other workers steal from the top.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	mr_step_t* steps;
+	size_t top;
+	size_t bottom;
+	size_t capacity;
+} mr_deque_t;
+
+/*
+ * State shared by all the workers of a parallel crawl.
+ */
+typedef struct {
+	mr_crawler_function f;
+	void* extra_args;
+	unsigned int n_threads;
+	mr_deque_t* deques;
+	size_t pending;
+	int rc;
+} mr_parallel_crawl_t;
+
+typedef struct {
+	mr_parallel_crawl_t* crawl;
+	unsigned int id;
+} mr_worker_t;
+
+static void deque_push(mr_deque_t* deque, mr_heaplet_t* heaplet, const mr_heaplet_t* previous) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom == deque->capacity) {
+		if (deque->top > 0) {
+			memmove(deque->steps, deque->steps + deque->top, sizeof(mr_step_t) * (deque->bottom - deque->top));
+			deque->bottom -= deque->top;
+			deque->top = 0;
+		}
+		if (deque->bottom == deque->capacity) {
+			deque->capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+			deque->steps = realloc(deque->steps, sizeof(mr_step_t) * deque->capacity);
+		}
+	}
+	deque->steps[deque->bottom].heaplet = heaplet;
+	deque->steps[deque->bottom].previous = previous;
+	deque->steps[deque->bottom].previous_index = MR_NO_INDEX;
+	deque->bottom++;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+ * Take a step from a deque, from the bottom for its owner and from the top
+ * for thieves. Return false if the deque is empty.
+ */
+static bool deque_take(mr_deque_t* deque, mr_step_t* step, bool steal) {
+	bool ret = false;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top < deque->bottom) {
+		if (steal) {
+			*step = deque->steps[deque->top];
+			deque->top++;
+		} else {
+			deque->bottom--;
+			*step = deque->steps[deque->bottom];
+		}
+		ret = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return ret;
+}
+
+/*
+ * Crawl the heaplets scheduled for a worker, stealing from the other workers
+ * when it runs out of them. Each heaplet's neighbours are scheduled before
+ * its elements are crawled so that idle workers can pick them up.
+ */
+static void* parallel_crawl_worker(void* arg) {
+	mr_worker_t* worker = arg;
+	mr_parallel_crawl_t* crawl = worker->crawl;
+	mr_deque_t* own = &crawl->deques[worker->id];
+	crawl_thread_id = worker->id;
+	while (__atomic_load_n(&crawl->rc, __ATOMIC_RELAXED) == 0) {
+		mr_step_t step;
+		bool found = deque_take(own, &step, false);
+		for (unsigned int i=1; !found && i<crawl->n_threads; i++) {
+			found = deque_take(&crawl->deques[(worker->id + i) % crawl->n_threads], &step, true);
+		}
+		if (!found) {
+			if (__atomic_load_n(&crawl->pending, __ATOMIC_ACQUIRE) == 0) {
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		mr_heaplet_t* heaplet = step.heaplet;
+		mr_heaplet_t** neighbours;
+		size_t number_of_neighbours = published_neighbours(heaplet, &neighbours);
+		for (size_t i=0; i<number_of_neighbours; i++) {
+			mr_heaplet_t* neighbour = neighbours[i];
+			if (neighbour != step.previous && neighbour != NULL) {
+				__atomic_add_fetch(&crawl->pending, 1, __ATOMIC_RELAXED);
+				deque_push(own, neighbour, heaplet);
+			}
+		}
+		char* data = heaplet->data;
+		char* end_of_data = data + published_used(heaplet);
+		uint64_t items = 0;
+		while (data < end_of_data && __atomic_load_n(&crawl->rc, __ATOMIC_RELAXED) == 0) {
+			int rc = crawl->f(*((uint64_t*) data), data + sizeof(uint64_t), crawl->extra_args);
+			items++;
+			if (rc) {
+				int expected = 0;
+				__atomic_compare_exchange_n(&crawl->rc, &expected, rc, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+				break;
+			}
+			data = next_intem_in_heaplet(data);
+		}
+		MR_COUNT(heaplet->room, crawl_items, items);
+		__atomic_sub_fetch(&crawl->pending, 1, __ATOMIC_RELEASE);
+	}
+	crawl_thread_id = 0;
+	return NULL;
+}
+
+/*
+ * Same as mr_crawl but the heaplets are shared among n_threads workers, the
+ * calling thread being one of them. If n_threads is 0, one worker per online
+ * CPU is used. The crawler function is called concurrently and in no
+ * particular order. The first non-zero value it returns stops all the
+ * workers and is returned.
+ */
+int mr_crawl_parallel(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args, unsigned int n_threads) {
+	if (n_threads == 0) {
+		long n_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n_cpu > 0 ? n_cpu : 1;
+	}
+	mr_parallel_crawl_t crawl = {
+		.f = f,
+		.extra_args = extra_args,
+		.n_threads = n_threads,
+		.deques = calloc(n_threads, sizeof(mr_deque_t)),
+		.pending = 1,
+		.rc = 0,
+	};
+	mr_worker_t* workers = malloc(sizeof(mr_worker_t) * n_threads);
+	pthread_t* threads = malloc(sizeof(pthread_t) * n_threads);
+	for (unsigned int i=0; i<n_threads; i++) {
+		pthread_mutex_init(&crawl.deques[i].lock, NULL);
+		workers[i].crawl = &crawl;
+		workers[i].id = i;
+	}
+	deque_push(&crawl.deques[0], heaplet, NULL);
+	unsigned int started = 1;
+	for (; started<n_threads; started++) {
+		if (pthread_create(&threads[started], NULL, parallel_crawl_worker, &workers[started])) {
+			break;
+		}
+	}
+	parallel_crawl_worker(&workers[0]);
+	for (unsigned int i=1; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (unsigned int i=0; i<n_threads; i++) {
+		pthread_mutex_destroy(&crawl.deques[i].lock);
+		free(crawl.deques[i].steps);
+	}
+	free(crawl.deques);
+	free(workers);
+	free(threads);
+	return crawl.rc;
+}
+
+/*
+ * Return the index of the worker of a parallel crawl running the calling
+ * crawler function, between 0 and n_threads-1. This can be used to index
+ * per-worker data and avoid locking. Return 0 outside of parallel crawls.
+ */
+unsigned int mr_crawl_thread_id(void) {
+	return crawl_thread_id;
+}
+
+/*
+ * A pattern searched for by mr_find. The pattern is copied in a buffer padded
+ * to a multiple of the widest vector so the kernels can load it whole.
+ */
+typedef struct {
+	uint64_t size;
+	size_t offset;
+	size_t pattern_size;
+	char* pattern;
+	uint64_t key_hash; // Only heaplets which may hold this key are searched, 0 for all
+} mr_search_t;
+
+#define MR_VECTOR_SIZE 32
+#define MR_SHORT_PATTERN_BUFFER 512 // Padded patterns up to this size are copied on the stack
+
+typedef bool (*mr_compare_function)(const char* data, const char* pattern, size_t n, const char* limit);
+
+/*
+ * Compare n bytes of an element with a pattern, one byte at a time.
+ */
+static bool compare_scalar(const char* data, const char* pattern, size_t n, const char* limit) {
+	(void) limit;
+	return memcmp(data, pattern, n) == 0;
+}
+
+#ifdef MR_X86_KERNELS
+/*
+ * Compare n bytes of an element with a pattern 16 bytes at a time. As long as
+ * it doesn't go past the end of the heaplet's buffer, a full vector is read
+ * and the bytes past n are masked out.
+ */
+__attribute__ ((target("sse2")))
+static bool compare_sse2(const char* data, const char* pattern, size_t n, const char* limit) {
+	size_t i = 0;
+	for (; i+16 <= n; i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (data + i));
+		__m128i b = _mm_loadu_si128((const __m128i*) (pattern + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) {
+			return false;
+		}
+	}
+	if (i == n) {
+		return true;
+	}
+	if (data + i + 16 > limit) {
+		return memcmp(data + i, pattern + i, n - i) == 0;
+	}
+	__m128i a = _mm_loadu_si128((const __m128i*) (data + i));
+	__m128i b = _mm_loadu_si128((const __m128i*) (pattern + i));
+	unsigned int mask = (1u << (n - i)) - 1;
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & mask) == mask;
+}
+
+/*
+ * Same as compare_sse2, with 32 bytes vectors.
+ */
+__attribute__ ((target("avx2")))
+static bool compare_avx2(const char* data, const char* pattern, size_t n, const char* limit) {
+	size_t i = 0;
+	for (; i+32 <= n; i+=32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*) (data + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*) (pattern + i));
+		if ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) != 0xFFFFFFFF) {
+			return false;
+		}
+	}
+	if (i == n) {
+		return true;
+	}
+	if (data + i + 32 > limit) {
+		return compare_sse2(data + i, pattern + i, n - i, limit);
+	}
+	__m256i a = _mm256_loadu_si256((const __m256i*) (data + i));
+	__m256i b = _mm256_loadu_si256((const __m256i*) (pattern + i));
+	unsigned int mask = (unsigned int) ((1ull << (n - i)) - 1);
+	return ((unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) & mask) == mask;
+}
+#endif
+
+/*
+ * Pick the widest comparison kernel the CPU supports.
+ */
+static mr_compare_function choose_compare_kernel(void) {
+#ifdef MR_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return compare_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return compare_sse2;
+	}
+#endif
+	return compare_scalar;
+}
+
+/*
+ * Look for the elements of a single heaplet matching a search. Up to
+ * max_matches of them are stored in matches. If first_only is set, the search
+ * stops at the first match. Return the number of matches.
+ */
+static size_t search_heaplet(const mr_heaplet_t* heaplet, const mr_search_t* search, mr_compare_function compare, char** matches, size_t max_matches, bool first_only) {
+	size_t ret = 0;
+	char* data = heaplet->data;
+	char* end_of_data = data + published_used(heaplet);
+	const char* limit = heaplet->data + heaplet->size;
+	while (data < end_of_data) {
+		uint64_t item_size = *((uint64_t*) data);
+		char* item = data + sizeof(uint64_t);
+		if ((search->size == MR_ANY_SIZE || search->size == item_size) &&
+				search->offset + search->pattern_size <= item_size &&
+				compare(item + search->offset, search->pattern, search->pattern_size, limit)) {
+			if (ret < max_matches) {
+				matches[ret] = item;
+			}
+			ret++;
+			if (first_only) {
+				return ret;
+			}
+		}
+		data = item + item_size;
+	}
+	return ret;
+}
+
+/*
+ * Look for the elements matching a search in the whole messy room. Return the
+ * number of matches, see search_heaplet.
+ */
+static size_t search_mr(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* pattern, size_t pattern_size, uint64_t key_hash, char** matches, size_t max_matches, bool first_only) {
+	static mr_compare_function chosen_compare = NULL; // Searches can run in several threads at once
+	mr_compare_function compare = __atomic_load_n(&chosen_compare, __ATOMIC_ACQUIRE);
+	if (compare == NULL) {
+		compare = choose_compare_kernel();
+		__atomic_store_n(&chosen_compare, compare, __ATOMIC_RELEASE);
+	}
+	char short_pattern[MR_SHORT_PATTERN_BUFFER];
+	bool is_short = pattern_size <= MR_SHORT_PATTERN_BUFFER - MR_VECTOR_SIZE;
+	mr_search_t search = {
+		.size = size,
+		.offset = offset,
+		.pattern_size = pattern_size,
+		.pattern = is_short ? short_pattern : malloc(pattern_size + MR_VECTOR_SIZE),
+		.key_hash = key_hash,
+	};
+	memcpy(search.pattern, pattern, pattern_size);
+	memset(search.pattern + pattern_size, 0, MR_VECTOR_SIZE);
+
+	size_t ret = 0;
+	mr_walker_t walker;
+	walker_init(&walker, heaplet);
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		walker_expand(&walker);
+		if (search.key_hash != 0 && !may_hold_key(heaplet, search.key_hash)) {
+			continue;
+		}
+		size_t stored = ret < max_matches ? ret : max_matches;
+		ret += search_heaplet(heaplet, &search, compare, matches == NULL ? NULL : matches + stored, max_matches - stored, first_only);
+		if (first_only && ret > 0) {
+			break;
+		}
+	}
+	walker_release(&walker);
+	if (!is_short) {
+		free(search.pattern);
+	}
+	return ret;
+}
+
+/*
+ * Return the first element of the messy room whose size is size and which
+ * contains pattern, of size pattern_size, at the given offset. The size can be
+ * MR_ANY_SIZE to match elements of any size. Return NULL if there is none.
+ */
+char* mr_find(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* pattern, size_t pattern_size) {
+	char* ret = NULL;
+	search_mr(heaplet, size, offset, pattern, pattern_size, 0, &ret, 1, true);
+	return ret;
+}
+
+/*
+ * Same as mr_find, looking for a key added with mr_add_keyed at the given
+ * offset of the elements. Heaplets whose filter rules the key out are
+ * skipped, those without a filter are searched whole.
+ */
+char* mr_find_keyed(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* key, size_t key_size) {
+	char* ret = NULL;
+	search_mr(heaplet, size, offset, key, key_size, checksum(key, key_size), &ret, 1, true);
+	return ret;
+}
+
+/*
+ * Same as mr_find, with the pattern at the beginning of the elements.
+ */
+char* mr_find_prefix(mr_heaplet_t* heaplet, uint64_t size, const void* prefix, size_t prefix_size) {
+	return mr_find(heaplet, size, 0, prefix, prefix_size);
+}
+
+/*
+ * Look for all the elements matching the same criteria as mr_find. Up to
+ * max_matches of them are stored in matches and the total number of matches
+ * is returned.
+ */
+size_t mr_find_all(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* pattern, size_t pattern_size, char** matches, size_t max_matches) {
+	return search_mr(heaplet, size, offset, pattern, pattern_size, 0, matches, max_matches, false);
+}
+
+/*
+ * Write the content of a messy room to an array, it the given array is NULL,
+ * nothing is written.
+ * Return the number of char needed to serialize the messy room.
+ */
+size_t mr_write_to_array(mr_heaplet_t* heaplet, char* dest) {
+	return mr_write_to_array_flags(heaplet, dest, 0);
+}
+
+/*
+ * Same as mr_write_to_array, the flags are a combination of MR_WRITE_*.
+ */
+size_t mr_write_to_array_flags(mr_heaplet_t* heaplet, char* dest, int flags) {
+	struct to_array_s {
+		char* data;
+		size_t index;
+	};
+
+	void write_to_array(void* arg, const char* buffer, size_t n) {
+		struct to_array_s* context = arg;
+		memcpy(context->data + context->index, buffer, n);
+		context->index += n;
+	}
+
+	void do_nothing(void* _arg, const char* _buffer, size_t _n) {
+		(void) _arg;
+		(void) _buffer;
+		(void) _n;
+	}
+
+	struct to_array_s context = {.data = dest, .index = 0};
+	size_t ret;
+	if (flags & MR_WRITE_LEGACY) {
+		ret = serialize_mr(&context, heaplet, dest == NULL ? do_nothing : write_to_array);
+	} else {
+		ret = serialize_mr_v2(&context, heaplet, write_to_array, dest == NULL, -1, flags);
+	}
+	MR_COUNT(heaplet->room, serialized_bytes, dest == NULL ? 0 : ret);
+	return ret;
+}
+
+/*
+ * Write the content of a messy room to a file.
+ */
+size_t mr_write_to_file(mr_heaplet_t* heaplet, FILE* f) {
+	return mr_write_to_file_flags(heaplet, f, 0);
+}
+
+/*
+ * Same as mr_write_to_file, the flags are a combination of MR_WRITE_*.
+ */
+size_t mr_write_to_file_flags(mr_heaplet_t* heaplet, FILE* f, int flags) {
+	void write_to_file(void* arg, const char* buffer, size_t n) {
+		fwrite(buffer, 1, n, (FILE*) arg);
+	}
+
+	size_t ret;
+	if (flags & MR_WRITE_LEGACY) {
+		ret = serialize_mr(f, heaplet, write_to_file);
+	} else {
+		ret = serialize_mr_v2(f, heaplet, write_to_file, false, ftell(f), flags);
+	}
+	MR_COUNT(heaplet->room, serialized_bytes, ret);
+	return ret;
+}
+
+/*
+ * Find the fill cursor of an heaplet read from the legacy format without fill
+ * cursors: its elements go up to the first 0 size or the first one which
+ * does not fit.
+ */
+static size_t chained_used(const char* data, size_t size) {
+	size_t ret = 0;
+	while (size - ret >= sizeof(uint64_t)) {
+		uint64_t item_size = decode_64_le(data + ret);
+		if (item_size == 0 || item_size > size - ret - sizeof(uint64_t)) {
+			break;
+		}
+		ret += sizeof(uint64_t) + item_size;
+	}
+	return ret;
+}
+
+/*
+ * Tell if a serialized messy room is in the legacy format with fill cursors.
+ */
+static bool is_legacy_with_cursors(const char* data, size_t size) {
+	return size >= sizeof(uint64_t) && !memcmp(data, MR_LEGACY_MAGIC, sizeof(uint64_t));
+}
+
+/*
+ * Tell if a serialized messy room is in the version 2 format.
+ */
+static bool is_v2(const char* data, size_t size) {
+	return size >= sizeof(uint64_t) && !memcmp(data, MR_V2_MAGIC, sizeof(uint64_t));
+}
+
+/*
+ * State of the decoding of a messy room given in chunks. Heaplets of the
+ * legacy format are made as they come, with the neighbours they have not been
+ * reached from made when they are reached. A messy room in the version 2
+ * format is gathered whole in a buffer and loaded once it is complete.
+ */
+enum {
+	MR_READER_START,            // Reading the first 8 bytes, to tell the format
+	MR_READER_V2_HEADER,
+	MR_READER_V2_BODY,
+	MR_READER_HEAPLET_HEADER,   // Size and maybe fill cursor of a legacy heaplet
+	MR_READER_HEAPLET_DATA,
+	MR_READER_HEAPLET_FOOTER,   // Number of its neighbours
+	MR_READER_DONE,
+	MR_READER_FAILED,
+};
+
+/*
+ * A legacy heaplet some of whose neighbours are still to be read.
+ */
+typedef struct {
+	mr_heaplet_t* heaplet;
+	uint64_t left;
+} mr_pending_t;
+
+struct mr_reader_s {
+	mr_reader_limits_t limits;
+	int state;
+	char fields[MR_V2_HEADER_BYTES]; // Fixed size part being read
+	size_t fields_size;
+	bool cursors;            // The legacy messy room has fill cursors
+	char* buffer;            // Messy room in the version 2 format
+	uint64_t buffer_size;
+	uint64_t buffer_capacity;
+	uint64_t buffered;
+	mr_heaplet_t* root;      // Of the legacy messy room being read
+	mr_heaplet_t* current;   // Legacy heaplet being read
+	uint64_t current_read;
+	uint64_t current_capacity; // Allocated for the data of the current heaplet
+	mr_pending_t* pending;   // Stack of the heaplets with neighbours to read
+	size_t pending_depth;
+	size_t pending_capacity;
+	uint64_t heaplets;       // Read or announced
+	uint64_t total_size;     // Of the heaplets read
+};
+
+/*
+ * Make a reader to decode a messy room in any format from chunks of input.
+ * There is no limit on what it reads until mr_reader_set_limits is called.
+ */
+mr_reader_t* mr_reader_new(void) {
+	mr_reader_t* reader = calloc(1, sizeof(mr_reader_t));
+	reader->state = MR_READER_START;
+	return reader;
+}
+
+/*
+ * Set the limits of what a reader accepts, to be called before feeding it.
+ */
+void mr_reader_set_limits(mr_reader_t* reader, const mr_reader_limits_t* limits) {
+	reader->limits = *limits;
+}
+
+/*
+ * Number of bytes a reader expects before the end of what it is reading: the
+ * rest of a field or an heaplet's data, or of a messy room in the version 2
+ * format. It is 0 once the messy room is complete or after an error.
+ */
+size_t mr_reader_needed(const mr_reader_t* reader) {
+	switch (reader->state) {
+		case MR_READER_START:
+			return sizeof(uint64_t) - reader->fields_size;
+		case MR_READER_V2_HEADER:
+			return MR_V2_HEADER_BYTES - reader->fields_size;
+		case MR_READER_V2_BODY:
+			return reader->buffer_size - reader->buffered;
+		case MR_READER_HEAPLET_HEADER:
+			return (reader->cursors ? 2 : 1) * sizeof(uint64_t) - reader->fields_size;
+		case MR_READER_HEAPLET_DATA:
+			return reader->current->size - reader->current_read;
+		case MR_READER_HEAPLET_FOOTER:
+			return sizeof(uint64_t) - reader->fields_size;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Fail the decoding with an error message.
+ */
+static bool reader_fail(mr_reader_t* reader, const char* message) {
+	fprintf(stderr, "[MESSY ROOM] Error, %s.\n", message);
+	reader->state = MR_READER_FAILED;
+	return false;
+}
+
+/*
+ * Make sure a buffer filled by a reader can take needed bytes. Buffers grow
+ * as their bytes come, up to their size, rather than being allocated whole
+ * from a size read from the input, which could be a lie. Return false if it
+ * can't be allocated.
+ */
+#define MR_READER_FIRST_BUFFER (64 * 1024)
+static bool reader_grow(char** buffer, uint64_t* capacity, uint64_t needed, uint64_t size) {
+	if (needed <= *capacity) {
+		return true;
+	}
+	uint64_t new_capacity = *capacity < MR_READER_FIRST_BUFFER ? MR_READER_FIRST_BUFFER : *capacity;
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+	if (new_capacity > size) {
+		new_capacity = size;
+	}
+	char* grown = realloc(*buffer, new_capacity);
+	if (grown == NULL) {
+		return false;
+	}
+	*buffer = grown;
+	*capacity = new_capacity;
+	return true;
+}
+
+/*
+ * Make the legacy heaplet whose header has been read, as the next neighbour
+ * of the heaplet on top of the pending stack.
+ */
+static bool reader_new_heaplet(mr_reader_t* reader) {
+	uint64_t size = decode_64_le(reader->fields);
+	uint64_t used = reader->cursors ? decode_64_le(reader->fields + sizeof(uint64_t)) : 0;
+	if (used > size) {
+		return reader_fail(reader, "unable to read a valid fill cursor");
+	}
+	uint64_t total_size = reader->total_size + size < reader->total_size ? UINT64_MAX : reader->total_size + size;
+	if (!within_limits(&reader->limits, size, total_size)) {
+		reader->state = MR_READER_FAILED;
+		return false;
+	}
+	mr_heaplet_t* heaplet;
+	if (reader->root == NULL) {
+		heaplet = new_heaplet(0, NULL);
+		reader->root = heaplet;
+		reader->heaplets = 1;
+	} else {
+		mr_pending_t* parent = &reader->pending[reader->pending_depth - 1];
+		heaplet = new_heaplet(0, parent->heaplet);
+		new_neighbour(parent->heaplet, heaplet);
+		parent->left--;
+	}
+	free(heaplet->data);
+	reader->current_capacity = size < MR_READER_FIRST_BUFFER ? size : MR_READER_FIRST_BUFFER;
+	heaplet->data = calloc(reader->current_capacity, 1);
+	if (heaplet->data == NULL) {
+		return reader_fail(reader, "unable to allocate an heaplet");
+	}
+	heaplet->size = size;
+	heaplet->used = used;
+	reader->total_size = total_size;
+	reader->current = heaplet;
+	reader->current_read = 0;
+	return true;
+}
+
+/*
+ * Take note of the neighbours of the legacy heaplet just read and find where
+ * the next heaplet goes, if any.
+ */
+static bool reader_end_heaplet(mr_reader_t* reader) {
+	uint64_t neighbours = decode_64_le(reader->fields);
+	uint64_t max_heaplets = reader->limits.max_heaplets == 0 ? UINT64_MAX : reader->limits.max_heaplets;
+	if (neighbours > max_heaplets - reader->heaplets) {
+		return reader_fail(reader, "invalid number of neighbours");
+	}
+	reader->heaplets += neighbours;
+	if (neighbours > 0) {
+		if (reader->pending_depth == reader->pending_capacity) {
+			reader->pending_capacity = reader->pending_capacity == 0 ? 64 : reader->pending_capacity * 2;
+			reader->pending = realloc(reader->pending, sizeof(mr_pending_t) * reader->pending_capacity);
+		}
+		reader->pending[reader->pending_depth] = (mr_pending_t) {.heaplet = reader->current, .left = neighbours};
+		reader->pending_depth++;
+	}
+	while (reader->pending_depth > 0 && reader->pending[reader->pending_depth - 1].left == 0) {
+		reader->pending_depth--;
+	}
+	reader->state = reader->pending_depth == 0 ? MR_READER_DONE : MR_READER_HEAPLET_HEADER;
+	return true;
+}
+
+/*
+ * Go on once the part of the input a reader expected has been read.
+ */
+static bool reader_advance(mr_reader_t* reader) {
+	switch (reader->state) {
+		case MR_READER_START:
+			if (is_v2(reader->fields, reader->fields_size)) {
+				reader->state = MR_READER_V2_HEADER;
+			} else if (is_legacy_with_cursors(reader->fields, reader->fields_size)) {
+				reader->fields_size = 0;
+				reader->cursors = true;
+				reader->state = MR_READER_HEAPLET_HEADER;
+			} else { // What has been read is the size of the first heaplet
+				reader->state = MR_READER_HEAPLET_HEADER;
+			}
+			return true;
+		case MR_READER_V2_HEADER: {
+			uint64_t total_size = decode_64_le(reader->fields + MR_V2_HEADER_TOTAL_SIZE * sizeof(uint64_t));
+			uint64_t count = decode_64_le(reader->fields + MR_V2_HEADER_HEAPLETS * sizeof(uint64_t));
+			if (total_size < MR_V2_HEADER_BYTES || (reader->limits.max_heaplets != 0 && count > reader->limits.max_heaplets)) {
+				return reader_fail(reader, "invalid header");
+			}
+			if (reader->limits.max_total_size != 0 && total_size > reader->limits.max_total_size) {
+				return reader_fail(reader, "messy room too big");
+			}
+			if (!reader_grow(&reader->buffer, &reader->buffer_capacity, MR_V2_HEADER_BYTES, total_size)) {
+				return reader_fail(reader, "unable to allocate the messy room");
+			}
+			memcpy(reader->buffer, reader->fields, MR_V2_HEADER_BYTES);
+			reader->buffer_size = total_size;
+			reader->buffered = MR_V2_HEADER_BYTES;
+			reader->state = MR_READER_V2_BODY;
+			return true;
+		}
+		case MR_READER_V2_BODY:
+			reader->state = MR_READER_DONE;
+			return true;
+		case MR_READER_HEAPLET_HEADER:
+			reader->fields_size = 0;
+			reader->state = MR_READER_HEAPLET_DATA;
+			return reader_new_heaplet(reader);
+		case MR_READER_HEAPLET_DATA:
+			if (!reader->cursors) {
+				reader->current->used = chained_used(reader->current->data, reader->current->size);
+			}
+			reader->state = MR_READER_HEAPLET_FOOTER;
+			return true;
+		case MR_READER_HEAPLET_FOOTER:
+			reader->fields_size = 0;
+			return reader_end_heaplet(reader);
+		default:
+			return false;
+	}
+}
+
+/*
+ * Give the next size bytes of a serialized messy room to a reader. They can
+ * be cut anywhere. Return false in case of error, including bytes past the
+ * end of the messy room, after which the reader only has to be finished.
+ */
+bool mr_reader_feed(mr_reader_t* reader, const void* buffer, size_t size) {
+	const char* input = buffer;
+	while (reader->state != MR_READER_FAILED) {
+		size_t needed = mr_reader_needed(reader);
+		if (needed == 0 && reader->state != MR_READER_DONE) {
+			reader_advance(reader);
+			continue;
+		}
+		if (size == 0) {
+			return true;
+		}
+		if (reader->state == MR_READER_DONE) {
+			return reader_fail(reader, "data past the end of the messy room");
+		}
+		size_t n = size < needed ? size : needed;
+		switch (reader->state) {
+			case MR_READER_V2_BODY:
+				if (!reader_grow(&reader->buffer, &reader->buffer_capacity, reader->buffered + n, reader->buffer_size)) {
+					return reader_fail(reader, "unable to allocate the messy room");
+				}
+				memcpy(reader->buffer + reader->buffered, input, n);
+				reader->buffered += n;
+				break;
+			case MR_READER_HEAPLET_DATA:
+				if (!reader_grow(&reader->current->data, &reader->current_capacity, reader->current_read + n, reader->current->size)) {
+					return reader_fail(reader, "unable to allocate an heaplet");
+				}
+				memcpy(reader->current->data + reader->current_read, input, n);
+				reader->current_read += n;
+				break;
+			default:
+				memcpy(reader->fields + reader->fields_size, input, n);
+				reader->fields_size += n;
+				break;
+		}
+		input += n;
+		size -= n;
+	}
+	return false;
+}
+
+/*
+ * Free a reader and return the messy room it has read, or NULL if it is
+ * incomplete or invalid.
+ */
+mr_heaplet_t* mr_reader_finish(mr_reader_t* reader) {
+	mr_heaplet_t* ret = NULL;
+	if (reader->state == MR_READER_DONE && reader->buffer != NULL) {
+		mr_source_t source = {.array = reader->buffer, .fd = -1, .base = 0, .size = reader->buffer_size, .limits = &reader->limits};
+		ret = load_mr_v2(&source, 0, new_room());
+	} else if (reader->state == MR_READER_DONE) {
+		ret = reader->root;
+		reader->root = NULL;
+	} else if (reader->state != MR_READER_FAILED) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to read needed char.\n");
+	}
+	if (reader->root != NULL) {
+		mr_free(reader->root);
+	}
+	free(reader->buffer);
+	free(reader->pending);
+	free(reader);
+	return ret;
+}
+
+/*
+ * Read a messy room serialized in an array, in any format. Trailing bytes
+ * after a legacy messy room are ignored.
+ */
+mr_heaplet_t* mr_read_from_array(char* data, size_t size) {
+	if (is_v2(data, size)) {
+		return mr_read_subtree_from_array(data, size, 0);
+	}
+	// Each legacy heaplet takes at least 2 numbers and is stored whole
+	mr_reader_limits_t limits = {.max_heaplets = size / (2 * sizeof(uint64_t)), .max_heaplet_size = size, .max_total_size = size};
+	mr_reader_t* reader = mr_reader_new();
+	mr_reader_set_limits(reader, &limits);
+	size_t index = 0;
+	size_t needed;
+	while (index < size && (needed = mr_reader_needed(reader)) > 0) {
+		size_t n = needed < size - index ? needed : size - index;
+		if (!mr_reader_feed(reader, data + index, n)) {
+			break;
+		}
+		index += n;
+	}
+	return mr_reader_finish(reader);
+}
+
+/*
+ * Read the part of a messy room serialized in the version 2 format in an
+ * array that is reachable from the heaplet of index id without going through
+ * the neighbour it has been reached from when it was written.
+ */
+mr_heaplet_t* mr_read_subtree_from_array(char* data, size_t size, uint64_t id) {
+	if (!is_v2(data, size)) {
+		fprintf(stderr, "[MESSY ROOM] Error, subtrees can only be read from the version 2 format.\n");
+		return NULL;
+	}
+	mr_source_t source = {.array = data, .fd = -1, .base = 0, .size = size};
+	return load_mr_v2(&source, id, new_room());
+}
+
+/*
+ * Read a subtree, as with mr_read_subtree_from_array, of a messy room in the
+ * version 2 format starting at the given offset of a file. The file is left
+ * at the end of the messy room.
+ */
+static mr_heaplet_t* read_subtree_from_file_at(FILE* f, off_t base, uint64_t id) {
+	mr_source_t source = {.array = NULL, .fd = fileno(f), .base = base, .size = SIZE_MAX};
+	mr_heaplet_t* ret = load_mr_v2(&source, id, new_room());
+	if (ret != NULL) {
+		fseeko(f, base + source.size, SEEK_SET);
+	}
+	return ret;
+}
+
+/*
+ * Read a messy room serialized in a file, in any format. Only its bytes are
+ * read from the file.
+ */
+#define MR_READ_CHUNK_SIZE (64 * 1024)
+mr_heaplet_t* mr_read_from_file(FILE* f) {
+	off_t base = ftello(f);
+	char prefix[sizeof(uint64_t)];
+	size_t prefix_size = fread(prefix, 1, sizeof(prefix), f);
+	if (base >= 0 && is_v2(prefix, prefix_size)) {
+		return read_subtree_from_file_at(f, base, 0);
+	}
+
+	// Legacy messy rooms and files which can't be read at random offsets,
+	// limited by what is left of the file if its size is known
+	mr_reader_t* reader = mr_reader_new();
+	struct stat st;
+	if (base >= 0 && !fstat(fileno(f), &st) && S_ISREG(st.st_mode) && st.st_size >= base) {
+		size_t size = st.st_size - base;
+		mr_reader_limits_t limits = {.max_heaplets = size / (2 * sizeof(uint64_t)), .max_heaplet_size = size, .max_total_size = size};
+		mr_reader_set_limits(reader, &limits);
+	}
+	char* chunk = malloc(MR_READ_CHUNK_SIZE);
+	bool ok = mr_reader_feed(reader, prefix, prefix_size);
+	size_t needed;
+	while (ok && (needed = mr_reader_needed(reader)) > 0) {
+		size_t n = fread(chunk, 1, needed < MR_READ_CHUNK_SIZE ? needed : MR_READ_CHUNK_SIZE, f);
+		ok = n > 0 && mr_reader_feed(reader, chunk, n);
+	}
+	free(chunk);
+	return mr_reader_finish(reader);
+}
+
+/*
+ * Read a subtree, as with mr_read_subtree_from_array, of a messy room
+ * serialized in the version 2 format in a file. Only the needed heaplets are
+ * read from the file.
+ */
+mr_heaplet_t* mr_read_subtree_from_file(FILE* f, uint64_t id) {
+	off_t base = ftello(f);
+	if (base < 0) {
+		fprintf(stderr, "[MESSY ROOM] Error, subtrees can only be read from seekable files.\n");
+		return NULL;
+	}
+	return read_subtree_from_file_at(f, base, id);
+}
+
+/*
+ * Read the heaplets of a messy room serialized in a mapped file. Their data
+ * is left in the mapping. Return false in case of error.
+ */
+static bool map_mr(mr_heaplet_t* root) {
+	mr_room_t* room = root->room;
+	room->mapping_cursors = is_legacy_with_cursors(room->mapping, room->mapping_size);
+	size_t header_size = (room->mapping_cursors ? 2 : 1) * sizeof(uint64_t);
+	size_t index = room->mapping_cursors ? sizeof(uint64_t) : 0;
+	bool ret = true;
+	mr_heaplet_t* heaplet;
+	mr_walker_t walker;
+	walker_init(&walker, root);
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		if (room->mapping_size - index < header_size) {
+			fprintf(stderr, "[MESSY ROOM] Error, unable to read an heaplet header.\n");
+			ret = false;
+			break;
+		}
+		uint64_t size = decode_64_le(room->mapping + index);
+		uint64_t used = room->mapping_cursors ? decode_64_le(room->mapping + index + sizeof(uint64_t)) : 0;
+		index += header_size;
+		if (size > room->mapping_size - index || room->mapping_size - index - size < sizeof(uint64_t)) {
+			fprintf(stderr, "[MESSY ROOM] Error, heaplet goes past the end of the file.\n");
+			ret = false;
+			break;
+		}
+		if (!room->mapping_cursors) {
+			used = chained_used(room->mapping + index, size);
+		} else if (used > size) {
+			fprintf(stderr, "[MESSY ROOM] Error, unable to read a valid fill cursor.\n");
+			ret = false;
+			break;
+		}
+		free(heaplet->data);
+		heaplet->size = size;
+		heaplet->used = used;
+		heaplet->data = room->mapping + index;
+		index += size;
+		uint64_t number_of_neighbours = decode_64_le(room->mapping + index);
+		index += sizeof(uint64_t);
+		if (number_of_neighbours > (room->mapping_size - index) / (header_size + sizeof(uint64_t))) {
+			fprintf(stderr, "[MESSY ROOM] Error, invalid number of neighbours.\n");
+			ret = false;
+			break;
+		}
+		add_empty_neighbours(heaplet, walker.current.previous, number_of_neighbours);
+	}
+	walker_release(&walker);
+	return ret;
+}
+
+/*
+ * Open a messy room serialized in a file by mapping it in memory. The
+ * heaplets' data is used directly from the mapping instead of being copied.
+ * With MR_MAP_READ_ONLY, the room must not be modified and new elements are
+ * put in new heaplets. With MR_MAP_PRIVATE, modifications are not written to
+ * the file. With MR_MAP_SHARED, modifications of the elements and elements
+ * added in the free space of the mapped heaplets are written to the file,
+ * and the checksum of an heaplet is cleared when an element is added to it
+ * or mr_touch reports a change in it. Elements put in new heaplets are only
+ * in memory in all cases. Heaplets used from the mapping are not checked
+ * against their checksum, only the copied ones are.
+ * Return NULL in case of error.
+ */
+mr_heaplet_t* mr_open_mapped(const char* path, int flags) {
+	int fd = open(path, flags == MR_MAP_SHARED ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to open %s.\n", path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size == 0) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to map empty file %s.\n", path);
+		close(fd);
+		return NULL;
+	}
+	int protection = flags == MR_MAP_READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+	char* mapping = mmap(NULL, st.st_size, protection, flags == MR_MAP_SHARED ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to map %s.\n", path);
+		return NULL;
+	}
+	mr_room_t* room = new_room();
+	room->mapping = mapping;
+	room->mapping_size = st.st_size;
+	room->mapping_flags = flags;
+	if (is_v2(mapping, st.st_size)) {
+		mr_source_t source = {.array = mapping, .fd = -1, .base = 0, .size = st.st_size};
+		mr_heaplet_t* ret = load_mr_v2(&source, 0, room);
+		if (ret != NULL) {
+			room->mapping_directory = mapping + decode_64_le(mapping + MR_V2_HEADER_DIRECTORY * sizeof(uint64_t));
+			room->mapping_entry_size = decode_64_le(mapping + MR_V2_HEADER_ENTRY_SIZE * sizeof(uint64_t));
+		}
+		return ret;
+	}
+	mr_heaplet_t* ret = new_first_heaplet(room, 0);
+	if (!map_mr(ret)) {
+		mr_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/*
+ * Find the heaplet of a messy room whose data contains the given address, or
+ * NULL if there is none. The heaplets are sorted by address on the first
+ * search after new ones have been made.
+ */
+static mr_heaplet_t* find_heaplet_by_address(mr_heaplet_t* heaplet, const char* address) {
+	mr_room_t* room = heaplet->room;
+	if (room->by_address_stale) {
+		int compare_addresses(const void* a, const void* b) {
+			const char* data_a = (*(mr_heaplet_t* const*) a)->data;
+			const char* data_b = (*(mr_heaplet_t* const*) b)->data;
+			return (data_a > data_b) - (data_a < data_b);
+		}
+		room->by_address_count = 0;
+		mr_walker_t walker;
+		walker_init(&walker, heaplet);
+		size_t capacity = 0;
+		while ((heaplet = walker_next(&walker)) != NULL) {
+			walker_expand(&walker);
+			if (room->by_address_count == capacity) {
+				capacity = capacity < 8 ? 16 : capacity * 2;
+				room->by_address = realloc(room->by_address, sizeof(mr_heaplet_t*) * capacity);
+			}
+			room->by_address[room->by_address_count] = heaplet;
+			room->by_address_count++;
+		}
+		walker_release(&walker);
+		qsort(room->by_address, room->by_address_count, sizeof(mr_heaplet_t*), compare_addresses);
+		room->by_address_stale = false;
+	}
+	size_t begin = 0;
+	size_t end = room->by_address_count;
+	while (begin < end) { // Last heaplet starting at or before the address
+		size_t middle = begin + (end - begin) / 2;
+		if (room->by_address[middle]->data <= address) {
+			begin = middle + 1;
+		} else {
+			end = middle;
+		}
+	}
+	if (begin == 0) {
+		return NULL;
+	}
+	mr_heaplet_t* ret = room->by_address[begin - 1];
+	return address < ret->data + ret->size ? ret : NULL;
+}
+
+/*
+ * Tell a messy room that size bytes of an element at data have been changed
+ * in place, so that mr_sync writes them back. Return false if they are not in
+ * the room.
+ */
+bool mr_touch(mr_heaplet_t* heaplet, const void* data, size_t size) {
+	const char* begin = data;
+	mr_heaplet_t* owner = heaplet;
+	if (begin < owner->data || begin >= owner->data + owner->size) {
+		owner = find_heaplet_by_address(heaplet, begin);
+	}
+	if (owner == NULL || size > (size_t) (owner->data + owner->size - begin)) {
+		fprintf(stderr, "[MESSY ROOM] Error, touched bytes are not in the messy room.\n");
+		return false;
+	}
+	mark_dirty(owner, begin - owner->data, begin - owner->data + size);
+	return true;
+}
+
+/*
+ * Write n bytes at an offset of a file.
+ */
+static bool pwrite_all(int fd, const char* buffer, size_t n, uint64_t offset) {
+	while (n > 0) {
+		ssize_t rc = pwrite(fd, buffer, n, offset);
+		if (rc <= 0) {
+			return false;
+		}
+		buffer += rc;
+		offset += rc;
+		n -= rc;
+	}
+	return true;
+}
+
+/*
+ * Append the heaplets of a messy room which are not in its file yet, and the
+ * packed ones which have changed, then a new directory and a new neighbour
+ * table, and point the header at them. The entries of the other heaplets
+ * already in the file are copied from the old directory, which is left unused
+ * in the file.
+ */
+static bool sync_structure(mr_room_t* room, int fd) {
+	bool ret = false;
+	size_t capacity = 64;
+	size_t count = 0;
+	mr_step_t* steps = malloc(sizeof(mr_step_t) * capacity);
+	mr_walker_t walker;
+	walker_init(&walker, room->file_root);
+	mr_heaplet_t* heaplet;
+	while ((heaplet = walker_next(&walker)) != NULL) {
+		walker_expand(&walker);
+		if (count == capacity) {
+			capacity *= 2;
+			steps = realloc(steps, sizeof(mr_step_t) * capacity);
+		}
+		steps[count] = walker.current;
+		count++;
+	}
+	walker_release(&walker);
+	mr_step_t* by_id = malloc(sizeof(mr_step_t) * count);
+	char* old_directory = malloc(room->file_heaplets * room->file_entry_size + 1);
+	char* directory = calloc(count, MR_V2_ENTRY_BYTES);
+	char* neighbours = NULL;
+	mr_source_t source = {.array = NULL, .fd = fd, .base = room->file_base, .size = room->file_size};
+	if (!source_read(&source, room->file_directory, old_directory, room->file_heaplets * room->file_entry_size)) {
+		goto end;
+	}
+
+	// New heaplets are numbered after the others and their data is appended,
+	// as is the data of the packed heaplets which have changed
+	uint64_t next_id = room->file_heaplets;
+	uint64_t file_end = room->file_size;
+	size_t neighbours_count = 0;
+	for (size_t i=0; i<count; i++) {
+		heaplet = steps[i].heaplet;
+		bool is_new = state_of(heaplet)->file_offset == MR_NOT_IN_FILE;
+		if (!is_new && heaplet->id >= room->file_heaplets) {
+			goto end;
+		}
+		if (is_new || state_of(heaplet)->file_offset == MR_REWRITE) {
+			if (!pwrite_all(fd, heaplet->data, heaplet->used, room->file_base + file_end)) { // The rest is a hole
+				goto end;
+			}
+			if (is_new) {
+				heaplet->id = next_id;
+				next_id++;
+			}
+			state_of(heaplet)->file_offset = file_end;
+			file_end += heaplet->size;
+		}
+		if (state_of(heaplet)->filter_dirty && state_of(heaplet)->filter_offset != MR_NOT_IN_FILE &&
+				!pwrite_all(fd, (const char*) state_of(heaplet)->filter, state_of(heaplet)->filter_size, room->file_base + state_of(heaplet)->filter_offset)) {
+			goto end; // Filters of packed heaplets are not written with the dirty bytes
+		}
+		state_of(heaplet)->filter_dirty = false;
+		if (state_of(heaplet)->filter != NULL && state_of(heaplet)->filter_offset == MR_NOT_IN_FILE) {
+			if (!pwrite_all(fd, (const char*) state_of(heaplet)->filter, state_of(heaplet)->filter_size, room->file_base + file_end)) {
+				goto end;
+			}
+			state_of(heaplet)->filter_offset = file_end;
+			state_of(heaplet)->filter_dirty = false;
+			file_end += state_of(heaplet)->filter_size;
+		}
+		by_id[heaplet->id] = steps[i];
+		neighbours_count += heaplet->number_of_neighbours;
+	}
+	if (next_id != count) {
+		goto end;
+	}
+
+	// The first neighbour of an heaplet is the one it is reached from, as in
+	// files written by serialize_mr_v2
+	neighbours = malloc(neighbours_count * sizeof(uint64_t) + 1);
+	size_t next_neighbour = 0;
+	for (size_t id=0; id<count; id++) {
+		heaplet = by_id[id].heaplet;
+		uint64_t entry[MR_V2_ENTRY_FIELDS];
+		char* dest = directory + id * MR_V2_ENTRY_BYTES;
+		if (id < room->file_heaplets) {
+			for (unsigned int j=0; j<MR_V2_ENTRY_FIELDS; j++) {
+				entry[j] = j < room->file_entry_size / sizeof(uint64_t) ? decode_64_le(old_directory + id * room->file_entry_size + j * sizeof(uint64_t)) : 0;
+			}
+			if (state_of(heaplet)->dirty_end != 0) {
+				entry[MR_V2_ENTRY_CHECKSUM] = 0;
+			}
+		}
+		if (id >= room->file_heaplets || (state_of(heaplet)->file_offset != MR_PACKED && state_of(heaplet)->file_offset != entry[MR_V2_ENTRY_DATA])) {
+			entry[MR_V2_ENTRY_DATA] = state_of(heaplet)->file_offset;
+			entry[MR_V2_ENTRY_HEAPLET_SIZE] = heaplet->size;
+			entry[MR_V2_ENTRY_STORED] = heaplet->size;
+			entry[MR_V2_ENTRY_ENCODING] = MR_ENCODING_RAW;
+			entry[MR_V2_ENTRY_CHECKSUM] = 0; // Only the used part has been written
+		}
+		entry[MR_V2_ENTRY_USED] = heaplet->used;
+		entry[MR_V2_ENTRY_FIRST_NEIGHBOUR] = next_neighbour;
+		entry[MR_V2_ENTRY_NEIGHBOURS] = heaplet->number_of_neighbours;
+		entry[MR_V2_ENTRY_FILTER] = state_of(heaplet)->filter == NULL ? 0 : state_of(heaplet)->filter_offset;
+		entry[MR_V2_ENTRY_FILTER_SIZE] = state_of(heaplet)->filter_size;
+		if (by_id[id].previous != NULL) {
+			encode_64_le(neighbours + next_neighbour * sizeof(uint64_t), by_id[id].previous->id);
+			next_neighbour++;
+		}
+		for (size_t j=0; j<heaplet->number_of_neighbours; j++) {
+			if (heaplet->neighbours[j] != by_id[id].previous) {
+				encode_64_le(neighbours + next_neighbour * sizeof(uint64_t), heaplet->neighbours[j]->id);
+				next_neighbour++;
+			}
+		}
+		for (unsigned int j=0; j<MR_V2_ENTRY_FIELDS; j++) {
+			encode_64_le(dest + j * sizeof(uint64_t), entry[j]);
+		}
+	}
+
+	uint64_t directory_offset = file_end;
+	uint64_t neighbours_offset = directory_offset + count * MR_V2_ENTRY_BYTES;
+	file_end = neighbours_offset + neighbours_count * sizeof(uint64_t);
+	if (!pwrite_all(fd, directory, count * MR_V2_ENTRY_BYTES, room->file_base + directory_offset) ||
+			!pwrite_all(fd, neighbours, neighbours_count * sizeof(uint64_t), room->file_base + neighbours_offset) ||
+			fsync(fd)) { // Everything is there before the header points at it
+		goto end;
+	}
+	char header[MR_V2_HEADER_BYTES];
+	uint64_t header_fields[MR_V2_HEADER_FIELDS] = {
+		[MR_V2_HEADER_VERSION] = MR_V2_VERSION,
+		[MR_V2_HEADER_TOTAL_SIZE] = file_end,
+		[MR_V2_HEADER_HEAPLETS] = count,
+		[MR_V2_HEADER_DIRECTORY] = directory_offset,
+		[MR_V2_HEADER_ENTRY_SIZE] = MR_V2_ENTRY_BYTES,
+		[MR_V2_HEADER_NEIGHBOURS] = neighbours_offset,
+		[MR_V2_HEADER_NEIGHBOURS_COUNT] = neighbours_count,
+	};
+	for (unsigned int i=0; i<MR_V2_HEADER_FIELDS; i++) {
+		encode_64_le(header + i * sizeof(uint64_t), header_fields[i]);
+	}
+	memcpy(header, MR_V2_MAGIC, sizeof(uint64_t));
+	if (!pwrite_all(fd, header, sizeof(header), room->file_base)) {
+		goto end;
+	}
+	room->file_size = file_end;
+	room->file_heaplets = count;
+	room->file_directory = directory_offset;
+	room->file_entry_size = MR_V2_ENTRY_BYTES;
+	ret = true;
+
+end:
+	free(steps);
+	free(by_id);
+	free(old_directory);
+	free(directory);
+	free(neighbours);
+	return ret;
+}
+
+/*
+ * Write the changes made to a messy room back to the file in the version 2
+ * format it has last been read from or written to. Only the changed bytes of
+ * the heaplets and their fill cursors are written in place. New heaplets are
+ * appended, as are the elided or compressed heaplets which have changed, along
+ * with a new directory and neighbour table if the heaplets or their
+ * neighbours have changed. Filters are written whole, in place or appended
+ * for heaplets which had none. The checksums of changed and new heaplets are
+ * cleared, as computing them would mean reading whole heaplets. The file is
+ * synced before returning. Return false on error.
+ */
+bool mr_sync(mr_heaplet_t* heaplet, int fd) {
+	mr_room_t* room = heaplet->room;
+	if (room->file_root == NULL) {
+		fprintf(stderr, "[MESSY ROOM] Error, the messy room is not in a file in the version 2 format.\n");
+		return false;
+	}
+	bool ok = true;
+	for (size_t i=0; i<room->dirty_count && ok; i++) {
+		mr_heaplet_t* current = room->dirty[i];
+		ok = pwrite_all(fd, current->data + state_of(current)->dirty_begin, state_of(current)->dirty_end - state_of(current)->dirty_begin, room->file_base + state_of(current)->file_offset + state_of(current)->dirty_begin);
+		if (ok && state_of(current)->filter_dirty) {
+			ok = pwrite_all(fd, (const char*) state_of(current)->filter, state_of(current)->filter_size, room->file_base + state_of(current)->filter_offset);
+		}
+	}
+	if (ok && room->structure_changed) {
+		ok = sync_structure(room, fd);
+	} else {
+		for (size_t i=0; i<room->dirty_count && ok; i++) { // Only the fill cursors and checksums change
+			mr_heaplet_t* current = room->dirty[i];
+			char fields[2 * sizeof(uint64_t)];
+			encode_64_le(fields, current->used);
+			uint64_t entry = room->file_base + room->file_directory + current->id * room->file_entry_size;
+			ok = pwrite_all(fd, fields, sizeof(uint64_t), entry + MR_V2_ENTRY_USED * sizeof(uint64_t));
+			encode_64_le(fields + sizeof(uint64_t), 0);
+			ok = ok && pwrite_all(fd, fields + sizeof(uint64_t), sizeof(uint64_t), entry + MR_V2_ENTRY_CHECKSUM * sizeof(uint64_t));
+		}
+	}
+	if (!ok || fsync(fd)) {
+		fprintf(stderr, "[MESSY ROOM] Error, unable to sync the messy room.\n");
+		return false;
+	}
+	for (size_t i=0; i<room->dirty_count; i++) {
+		state_of(room->dirty[i])->dirty_end = 0;
+		state_of(room->dirty[i])->filter_dirty = false;
+	}
+	room->dirty_count = 0;
+	room->structure_changed = false;
+	return true;
+}
@@ -3,26 +3,151 @@
 
 #include "stdlib.h"
 #include "stdint.h"
+#include "stdbool.h"
 #include "stdio.h"
+#include "sys/uio.h"
+
+typedef struct mr_room_s mr_room_t;
+typedef struct mr_compaction_s mr_compaction_t;
+typedef struct mr_reader_s mr_reader_t;
 
 typedef struct mr_heaplet_s {
 	size_t size;
+	size_t used;
+	size_t reserved; // Fill cursor of the space claimed by concurrent insertions
 	char* data;
 	size_t number_of_neighbours;
+	size_t neighbours_capacity;
 	struct mr_heaplet_s** neighbours;
+	mr_room_t* room;
+	uint64_t id; // Index of the heaplet in the file it has been read from
 } mr_heaplet_t;
 
+/*
+ * Size of the heaplets mr_add_data makes. The first one is min_size bytes and
+ * each next one is growth times bigger, up to max_size bytes (0 for no
+ * limit). Sizes are rounded up to a multiple of alignment (0 or 1 for no
+ * rounding) and heaplets are always big enough for the element being added.
+ */
+typedef struct {
+	size_t min_size;
+	unsigned int growth;
+	size_t alignment;
+	size_t max_size;
+} mr_sizing_t;
+
+/*
+ * What a messy room went through since it has been made or read, only
+ * counted if the library is compiled with MR_STATS_COUNTERS defined.
+ */
+typedef struct {
+	uint64_t add_calls;         // Elements added
+	uint64_t add_hops;          // Heaplets walked to while looking for room to add them
+	uint64_t heaplets_made;     // By insertions
+	uint64_t crawls;            // Calls to mr_crawl and mr_crawl_parallel
+	uint64_t crawl_items;       // Elements given to crawler functions
+	uint64_t serialized_bytes;  // Written to arrays and files
+} mr_counters_t;
+
+#define MR_FILL_BUCKETS   11
+#define MR_SIZE_BUCKETS   33
+#define MR_DEGREE_BUCKETS 17
+
+/*
+ * Shape of a messy room, as given by mr_stats. Heaplets are counted in
+ * fill[used * 10 / size], elements in element_sizes[0] if empty or
+ * element_sizes[i] if their size is in [2^(i-1), 2^i) and heaplets in
+ * degrees[number of neighbours]. The last bucket of each histogram takes
+ * everything above.
+ */
+typedef struct {
+	size_t heaplets;
+	size_t elements;
+	size_t total_bytes;
+	size_t used_bytes;
+	size_t fill[MR_FILL_BUCKETS];
+	size_t element_sizes[MR_SIZE_BUCKETS];
+	size_t depth;
+	size_t degrees[MR_DEGREE_BUCKETS];
+	size_t max_degree;
+	bool counting; // If counters has been filled
+	mr_counters_t counters;
+} mr_stats_t;
+
+/*
+ * What a mr_reader_t accepts before giving up on its input, 0 meaning no
+ * limit. The total size is the sum of the sizes of the heaplets, and the size
+ * of the serialized messy room in the version 2 format, which is gathered
+ * before being loaded.
+ */
+typedef struct {
+	uint64_t max_heaplets;
+	uint64_t max_heaplet_size;
+	uint64_t max_total_size;
+} mr_reader_limits_t;
+
+#define MR_ANY_SIZE UINT64_MAX
+
+#define MR_MAP_READ_ONLY 0
+#define MR_MAP_PRIVATE   1
+#define MR_MAP_SHARED    2
+
+#define MR_WRITE_LEGACY   1
+#define MR_WRITE_ELIDE    2 // Don't store the unused end of the heaplets
+#define MR_WRITE_COMPRESS 4 // Compress the used part of the heaplets
+
+#define MR_PLACE_RANDOM_WALK    0
+#define MR_PLACE_BOUNDED_PROBE  1
+#define MR_PLACE_FIRST_FIT      2
+#define MR_PLACE_LAST_WITH_ROOM 3
+
 typedef int (*mr_crawler_function)(uint64_t size, char* data, void* extra_args);
+typedef bool (*mr_filter_function)(uint64_t size, char* data, void* extra_args);
 
 mr_heaplet_t* mr_new(void);
+mr_heaplet_t* mr_new_with_capacity(size_t capacity);
+mr_heaplet_t* mr_new_in_arena(size_t size_hint);
 void mr_free(mr_heaplet_t* heaplet);
 mr_heaplet_t* mr_add_data(mr_heaplet_t* heaplet, size_t size, const void* data);
+mr_heaplet_t* mr_add_keyed(mr_heaplet_t* heaplet, const void* key, size_t key_size, size_t size, const void* data);
+mr_heaplet_t* mr_add_datav(mr_heaplet_t* heaplet, const struct iovec* items, size_t n);
+size_t mr_add_bulk(mr_heaplet_t* heaplet, uint64_t size, const void* data, size_t n, mr_heaplet_t** used, size_t max_used);
+char* mr_reserve(mr_heaplet_t* heaplet, size_t size, mr_heaplet_t** used);
+bool mr_commit(mr_heaplet_t* heaplet, char* data, size_t size);
+bool mr_abort(mr_heaplet_t* heaplet, char* data);
+mr_heaplet_t* mr_add_data_concurrent(mr_heaplet_t* heaplet, size_t size, const void* data);
+void mr_set_placement(mr_heaplet_t* heaplet, int policy);
+void mr_set_sizing(mr_heaplet_t* heaplet, const mr_sizing_t* sizing);
+void mr_set_seed(mr_heaplet_t* heaplet, uint64_t seed);
+mr_heaplet_t* mr_compact(mr_heaplet_t* heaplet, mr_filter_function keep, void* extra_args);
+mr_compaction_t* mr_compact_begin(mr_heaplet_t* heaplet, mr_filter_function keep, void* extra_args);
+bool mr_compact_step(mr_compaction_t* compaction, size_t budget);
+mr_heaplet_t* mr_compact_end(mr_compaction_t* compaction);
+void mr_stats(mr_heaplet_t* heaplet, mr_stats_t* stats);
 int mr_crawl(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args);
+int mr_crawl_parallel(mr_heaplet_t* heaplet, mr_crawler_function f, void* extra_args, unsigned int n_threads);
+unsigned int mr_crawl_thread_id(void);
+char* mr_find(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* pattern, size_t pattern_size);
+char* mr_find_keyed(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* key, size_t key_size);
+char* mr_find_prefix(mr_heaplet_t* heaplet, uint64_t size, const void* prefix, size_t prefix_size);
+size_t mr_find_all(mr_heaplet_t* heaplet, uint64_t size, size_t offset, const void* pattern, size_t pattern_size, char** matches, size_t max_matches);
 
 size_t mr_write_to_array(mr_heaplet_t* heaplet, char* dest);
+size_t mr_write_to_array_flags(mr_heaplet_t* heaplet, char* dest, int flags);
 size_t mr_write_to_file(mr_heaplet_t* heaplet, FILE* f);
+size_t mr_write_to_file_flags(mr_heaplet_t* heaplet, FILE* f, int flags);
 mr_heaplet_t* mr_read_from_array(char* data, size_t size);
 mr_heaplet_t* mr_read_from_file(FILE* f);
+mr_reader_t* mr_reader_new(void);
+void mr_reader_set_limits(mr_reader_t* reader, const mr_reader_limits_t* limits);
+size_t mr_reader_needed(const mr_reader_t* reader);
+bool mr_reader_feed(mr_reader_t* reader, const void* buffer, size_t size);
+mr_heaplet_t* mr_reader_finish(mr_reader_t* reader);
+mr_heaplet_t* mr_read_subtree_from_array(char* data, size_t size, uint64_t id);
+mr_heaplet_t* mr_read_subtree_from_file(FILE* f, uint64_t id);
+bool mr_touch(mr_heaplet_t* heaplet, const void* data, size_t size);
+bool mr_sync(mr_heaplet_t* heaplet, int fd);
+mr_heaplet_t* mr_open_mapped(const char* path, int flags);
 
 #endif
 
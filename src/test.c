@@ -3,6 +3,9 @@
 #include "string.h"
 #include "stdio.h"
 #include "time.h"
+#include "pthread.h"
+#include "fcntl.h"
+#include "unistd.h"
 
 #define GARBAGE_SIZE 100
 #define LOOP_COUNT   10000
@@ -40,9 +43,51 @@ static void basic_test(void) {
 	int rc = mr_crawl(heaplet, search_special_data, &number_of_tries);
 	printf("%s in %i tries\n", rc ? "Found special data" : "Special data not found" , number_of_tries);
 
+	// Find it again and count the elements with several threads
+	int search_special_data_parallel(uint64_t size, char* data, void* arg) {
+		(void) arg;
+		return size == sizeof(uint64_t) && *((uint64_t*) data) == special_data;
+	}
+	int count_elements_parallel(uint64_t size, char* data, void* arg) {
+		(void) size;
+		(void) data;
+		int* counters = arg;
+		counters[mr_crawl_thread_id()]++;
+		return 0;
+	}
+	rc = mr_crawl_parallel(heaplet, search_special_data_parallel, NULL, 4);
+	int counters[4] = {0};
+	mr_crawl_parallel(heaplet, count_elements_parallel, counters, 4);
+	printf("%s with 4 threads, %i elements counted\n", rc ? "Found special data" : "Special data not found", counters[0] + counters[1] + counters[2] + counters[3]);
+
+	// Find it with a pattern search
+	char* found = mr_find(heaplet, sizeof(uint64_t), 0, &special_data, sizeof(uint64_t));
+	size_t garbage_elements = mr_find_all(heaplet, GARBAGE_SIZE, 0, "", 0, NULL, 0);
+	printf("%s with a pattern search, %zu garbage elements\n", found != NULL ? "Found special data" : "Special data not found", garbage_elements);
+
+	mr_free(heaplet);
+
+	// Same room in an arena
+	heaplet = mr_new_in_arena(LOOP_COUNT * GARBAGE_SIZE);
+	for (int i=0; i<LOOP_COUNT; i++) {
+		char* garbage = malloc(GARBAGE_SIZE);
+		heaplet = mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+		free(garbage);
+	}
+	mr_add_data(heaplet, sizeof(uint64_t), &special_data);
+	found = mr_find(heaplet, sizeof(uint64_t), 0, &special_data, sizeof(uint64_t));
+	printf("%s in an arena\n", found != NULL ? "Found special data" : "Special data not found");
 	mr_free(heaplet);
 }
 
+static int count_elements(uint64_t size, char* data, void* arg) {
+	(void) size;
+	(void) data;
+	int* number_of_elements = arg;
+	*number_of_elements = *number_of_elements + 1;
+	return 0;
+}
+
 static void serialize_test(void) {
 	mr_heaplet_t* heaplet = mr_new();
 	const char* s1 = "Bobignou";
@@ -51,6 +96,7 @@ static void serialize_test(void) {
 	mr_add_data(heaplet, strlen(s2), s2);
 	const char* s3 = "^.^";
 	mr_add_data(heaplet, strlen(s3), s3);
+	mr_add_data(heaplet, 0, "");
 
 	FILE* f = fopen("test1.mr", "w");
 	mr_write_to_file(heaplet, f);
@@ -60,18 +106,420 @@ static void serialize_test(void) {
 	mr_heaplet_t* read_heaplet = mr_read_from_file(f);
 	fclose(f);
 
+	int number_of_elements = 0;
+	mr_crawl(read_heaplet, count_elements, &number_of_elements);
+	printf("Read back %i elements out of 4\n", number_of_elements);
+
+	size_t legacy_size = mr_write_to_array_flags(read_heaplet, NULL, MR_WRITE_LEGACY);
+	char* legacy = malloc(legacy_size);
+	mr_write_to_array_flags(read_heaplet, legacy, MR_WRITE_LEGACY);
+	mr_heaplet_t* legacy_heaplet = mr_read_from_array(legacy, legacy_size);
+	number_of_elements = 0;
+	mr_crawl(legacy_heaplet, count_elements, &number_of_elements);
+	printf("Read back %i elements out of 4 from the legacy format\n", number_of_elements);
+	mr_free(legacy_heaplet);
+	free(legacy);
+
+	mr_heaplet_t* mapped_heaplet = mr_open_mapped("test1.mr", MR_MAP_READ_ONLY);
+	number_of_elements = 0;
+	mr_crawl(mapped_heaplet, count_elements, &number_of_elements);
+	printf("Mapped %i elements out of 4\n", number_of_elements);
+	mr_free(mapped_heaplet);
+
 	f = fopen("test2.mr", "w");
 	mr_write_to_file(read_heaplet, f);
 	fclose(f);
 
+	// Change an element in place, add an other and write only that back
+	char* found = mr_find_prefix(read_heaplet, strlen(s1), "Bob", 3);
+	found[0] = 'R';
+	mr_touch(read_heaplet, found, 1);
+	mr_add_data(read_heaplet, strlen(s1), s1);
+	int fd = open("test2.mr", O_RDWR);
+	mr_sync(read_heaplet, fd);
+	close(fd);
+	f = fopen("test2.mr", "r");
+	mr_heaplet_t* synced_heaplet = mr_read_from_file(f);
+	fclose(f);
+	number_of_elements = 0;
+	mr_crawl(synced_heaplet, count_elements, &number_of_elements);
+	printf("%s, %i elements out of 5\n", mr_find_prefix(synced_heaplet, strlen(s1), "Rob", 3) != NULL ? "Synced change found" : "Synced change not found", number_of_elements);
+	mr_free(synced_heaplet);
+
+	mr_free(heaplet);
+	mr_free(read_heaplet);
+}
+
+static void placement_test(void) {
+	const char* names[] = {"random walk", "bounded probe", "first fit", "last with room"};
+	for (int policy=MR_PLACE_RANDOM_WALK; policy<=MR_PLACE_LAST_WITH_ROOM; policy++) {
+		mr_heaplet_t* heaplet = mr_new();
+		mr_set_placement(heaplet, policy);
+		mr_set_seed(heaplet, 42);
+		char garbage[GARBAGE_SIZE] = {0};
+		for (int i=0; i<LOOP_COUNT; i++) {
+			mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+		}
+		int number_of_elements = 0;
+		mr_crawl(heaplet, count_elements, &number_of_elements);
+		printf("Placed %i elements out of %i with %s\n", number_of_elements, LOOP_COUNT, names[policy]);
+		mr_free(heaplet);
+	}
+
+	// A first heaplet big enough for all the elements
+	mr_heaplet_t* heaplet = mr_new_with_capacity(LOOP_COUNT * (GARBAGE_SIZE + sizeof(uint64_t)));
+	char garbage[GARBAGE_SIZE] = {0};
+	for (int i=0; i<LOOP_COUNT; i++) {
+		mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+	}
+	printf("%s\n", heaplet->number_of_neighbours == 0 ? "All elements fit in the first heaplet" : "Elements did not fit in the first heaplet");
+	mr_free(heaplet);
+}
+
+static void sizing_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	mr_set_placement(heaplet, MR_PLACE_LAST_WITH_ROOM); // Each heaplet is made after the previous one
+	mr_sizing_t sizing = {.min_size = 1000, .growth = 3, .alignment = 512, .max_size = 10000};
+	mr_set_sizing(heaplet, &sizing);
+	char garbage[GARBAGE_SIZE] = {0};
+	for (int i=0; i<300; i++) {
+		mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+	}
+	char* big = calloc(20000, 1);
+	mr_add_data(heaplet, 20000, big);
+	free(big);
+	const size_t expected[] = {1024, 3072, 9216, 10240, 10240, 20480};
+	size_t number_of_heaplets = 0;
+	bool as_expected = true;
+	mr_heaplet_t* current = heaplet;
+	size_t next = 0; // Index of the neighbour made after the current heaplet
+	while (current->number_of_neighbours > next) {
+		current = current->neighbours[next];
+		next = 1;
+		as_expected = as_expected && number_of_heaplets < 6 && current->size == expected[number_of_heaplets];
+		number_of_heaplets++;
+	}
+	printf("%s, %zu heaplets made\n", as_expected && number_of_heaplets == 6 ? "Heaplets sized as expected" : "Heaplets not sized as expected", number_of_heaplets);
+	mr_free(heaplet);
+}
+
+static void concurrent_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	void* add_elements(void* arg) {
+		(void) arg;
+		char garbage[GARBAGE_SIZE] = {0};
+		for (int i=0; i<LOOP_COUNT; i++) {
+			mr_add_data_concurrent(heaplet, GARBAGE_SIZE, garbage);
+		}
+		return NULL;
+	}
+	pthread_t threads[4];
+	for (int i=0; i<4; i++) {
+		pthread_create(&threads[i], NULL, add_elements, NULL);
+	}
+	int number_of_elements = 0;
+	mr_crawl(heaplet, count_elements, &number_of_elements); // While elements are being added
+	for (int i=0; i<4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	number_of_elements = 0;
+	mr_crawl(heaplet, count_elements, &number_of_elements);
+	printf("Added %i elements out of %i with 4 threads\n", number_of_elements, 4 * LOOP_COUNT);
+	mr_free(heaplet);
+}
+
+static void compact_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	char garbage[GARBAGE_SIZE] = {0};
+	for (int i=0; i<LOOP_COUNT; i++) {
+		garbage[0] = i % 2; // Odd elements are to be dropped
+		mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+	}
+	mr_add_data(heaplet, sizeof(uint64_t), &special_data);
+	bool keep_even(uint64_t size, char* data, void* arg) {
+		(void) arg;
+		return size != GARBAGE_SIZE || data[0] == 0;
+	}
+	mr_heaplet_t* compacted = mr_compact(heaplet, keep_even, NULL);
+	int number_of_elements = 0;
+	mr_crawl(compacted, count_elements, &number_of_elements);
+	printf("Compacted %i elements out of %i into %zu heaplets\n", number_of_elements, LOOP_COUNT / 2 + 1, compacted->number_of_neighbours + 1);
+	mr_free(compacted);
+
+	// A bit at a time
+	mr_compaction_t* compaction = mr_compact_begin(heaplet, NULL, NULL);
+	int steps = 1;
+	while (!mr_compact_step(compaction, 64 * 1024)) {
+		steps++;
+	}
+	compacted = mr_compact_end(compaction);
+	char* found = mr_find(compacted, sizeof(uint64_t), 0, &special_data, sizeof(uint64_t));
+	printf("%s after compacting in %i steps\n", found != NULL ? "Found special data" : "Special data not found", steps);
+	mr_free(compacted);
+	mr_free(heaplet);
+}
+
+static void stats_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	mr_set_seed(heaplet, 42);
+	char garbage[GARBAGE_SIZE] = {0};
+	for (int i=0; i<LOOP_COUNT; i++) {
+		mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+	}
+	mr_stats_t stats;
+	mr_stats(heaplet, &stats);
+	size_t in_fill = 0;
+	size_t in_degrees = 0;
+	for (int i=0; i<MR_FILL_BUCKETS; i++) {
+		in_fill += stats.fill[i];
+	}
+	for (int i=0; i<MR_DEGREE_BUCKETS; i++) {
+		in_degrees += stats.degrees[i];
+	}
+	printf("Counted %zu elements out of %i in %zu heaplets, %s\n", stats.elements, LOOP_COUNT, stats.heaplets, in_fill == stats.heaplets && in_degrees == stats.heaplets && stats.used_bytes <= stats.total_bytes ? "histograms consistent" : "histograms inconsistent");
+	if (stats.counting) {
+		printf("Counted %llu additions with %llu hops\n", (unsigned long long) stats.counters.add_calls, (unsigned long long) stats.counters.add_hops);
+	}
 	mr_free(heaplet);
+}
+
+static void keyed_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	char element[16] = {0};
+	for (int i=0; i<LOOP_COUNT; i++) {
+		snprintf(element, sizeof(element), "key-%08i", i);
+		mr_add_keyed(heaplet, element, strlen(element) + 1, sizeof(element), element);
+	}
+	char* present = mr_find_keyed(heaplet, sizeof(element), 0, "key-00001234", 13);
+	char* absent = mr_find_keyed(heaplet, sizeof(element), 0, "key-99999999", 13);
+	printf("%s, %s\n", present != NULL ? "Found a key" : "Key not found", absent == NULL ? "no missing key found" : "missing key found");
+
+	// The filters are written with the room and synced with it
+	FILE* f = fopen("test2.mr", "w");
+	mr_write_to_file(heaplet, f);
+	fclose(f);
+	for (int i=LOOP_COUNT; i<2*LOOP_COUNT; i++) {
+		snprintf(element, sizeof(element), "key-%08i", i);
+		mr_add_keyed(heaplet, element, strlen(element) + 1, sizeof(element), element);
+	}
+	int fd = open("test2.mr", O_RDWR);
+	mr_sync(heaplet, fd);
+	close(fd);
+	f = fopen("test2.mr", "r");
+	mr_heaplet_t* read_heaplet = mr_read_from_file(f);
+	fclose(f);
+	int found = 0;
+	for (int i=0; i<2*LOOP_COUNT; i+=LOOP_COUNT/10) {
+		snprintf(element, sizeof(element), "key-%08i", i);
+		found += mr_find_keyed(read_heaplet, sizeof(element), 0, element, strlen(element) + 1) != NULL;
+	}
+	printf("Found %i keys out of 20 after syncing\n", found);
 	mr_free(read_heaplet);
+	mr_free(heaplet);
+}
+
+static void reader_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	char garbage[GARBAGE_SIZE] = {0};
+	for (int i=0; i<LOOP_COUNT; i++) {
+		mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+	}
+	const int flags[] = {0, MR_WRITE_LEGACY};
+	const char* names[] = {"version 2", "legacy"};
+	for (int i=0; i<2; i++) {
+		size_t size = mr_write_to_array_flags(heaplet, NULL, flags[i]);
+		char* array = malloc(size);
+		mr_write_to_array_flags(heaplet, array, flags[i]);
+		mr_reader_t* reader = mr_reader_new();
+		for (size_t offset=0; offset<size; offset+=7) { // As if it came from a slow pipe
+			mr_reader_feed(reader, array + offset, size - offset < 7 ? size - offset : 7);
+		}
+		mr_heaplet_t* read_heaplet = mr_reader_finish(reader);
+		int number_of_elements = 0;
+		if (read_heaplet != NULL) {
+			mr_crawl(read_heaplet, count_elements, &number_of_elements);
+			mr_free(read_heaplet);
+		}
+		printf("Read back %i elements out of %i in chunks from the %s format\n", number_of_elements, LOOP_COUNT, names[i]);
+		free(array);
+	}
+	mr_free(heaplet);
+
+	// A messy room written by the first versions, without fill cursors: a
+	// heaplet with two elements and 8 free bytes, then its neighbour with one
+	char baseline[80] = {0};
+	const uint64_t numbers[][2] = {{0, 32}, {8, 4}, {20, 4}, {40, 1}, {48, 16}, {56, 8}};
+	for (int i=0; i<6; i++) {
+		memcpy(baseline + numbers[i][0], &numbers[i][1], sizeof(uint64_t));
+	}
+	memcpy(baseline + 16, "abcd", 4);
+	memcpy(baseline + 28, "efgh", 4);
+	memcpy(baseline + 64, "ijklmnop", 8);
+	heaplet = mr_read_from_array(baseline, sizeof(baseline));
+	int number_of_elements = 0;
+	if (heaplet != NULL) {
+		mr_crawl(heaplet, count_elements, &number_of_elements);
+		mr_free(heaplet);
+	}
+	printf("Read back %i elements out of 3 from the legacy format without fill cursors\n", number_of_elements);
+
+	// A legacy heaplet claiming a huge number of neighbours
+	char bogus[2 * sizeof(uint64_t)] = {0};
+	memset(bogus + sizeof(uint64_t), 0x7F, sizeof(uint64_t));
+	mr_reader_limits_t limits = {.max_heaplets = 1000, .max_heaplet_size = 0, .max_total_size = 0};
+	mr_reader_t* reader = mr_reader_new();
+	mr_reader_set_limits(reader, &limits);
+	bool ok = mr_reader_feed(reader, bogus, sizeof(bogus));
+	heaplet = mr_reader_finish(reader);
+	printf("%s\n", !ok && heaplet == NULL ? "Rejected too many neighbours" : "Accepted too many neighbours");
+}
+
+static void subtree_test(void) {
+	// A chain of heaplets of 9 elements each, numbered in the order they are written
+	mr_heaplet_t* heaplet = mr_new();
+	mr_set_placement(heaplet, MR_PLACE_LAST_WITH_ROOM);
+	mr_sizing_t sizing = {.min_size = 9 * (GARBAGE_SIZE + sizeof(uint64_t)), .growth = 1, .alignment = 0, .max_size = 0};
+	mr_set_sizing(heaplet, &sizing);
+	char garbage[GARBAGE_SIZE] = {0};
+	for (int i=0; i<90; i++) {
+		mr_add_data(heaplet, GARBAGE_SIZE, garbage);
+	}
+	size_t size = mr_write_to_array(heaplet, NULL);
+	char* array = malloc(size);
+	mr_write_to_array(heaplet, array);
+	FILE* f = fopen("test2.mr", "w");
+	mr_write_to_file(heaplet, f);
+	fclose(f);
+	mr_free(heaplet);
+
+	// The heaplets after the second one of the chain
+	mr_heaplet_t* from_array = mr_read_subtree_from_array(array, size, 3);
+	f = fopen("test2.mr", "r");
+	mr_heaplet_t* from_file = mr_read_subtree_from_file(f, 3);
+	fclose(f);
+	int number_in_array = 0;
+	int number_in_file = 0;
+	if (from_array != NULL) {
+		mr_crawl(from_array, count_elements, &number_in_array);
+		mr_free(from_array);
+	}
+	if (from_file != NULL) {
+		mr_crawl(from_file, count_elements, &number_in_file);
+		mr_free(from_file);
+	}
+	printf("Read %i elements out of 72 from a subtree in an array, %i from a file\n", number_in_array, number_in_file);
+	free(array);
+}
+
+static void compression_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	char element[GARBAGE_SIZE] = {0};
+	for (int i=0; i<LOOP_COUNT; i++) {
+		snprintf(element, sizeof(element), "element-%i", i);
+		mr_add_data(heaplet, sizeof(element), element);
+	}
+	size_t raw_size = mr_write_to_array(heaplet, NULL);
+	const int flags[] = {MR_WRITE_ELIDE, MR_WRITE_COMPRESS};
+	const char* names[] = {"elided", "compressed"};
+	for (int i=0; i<2; i++) {
+		size_t size = mr_write_to_array_flags(heaplet, NULL, flags[i]);
+		char* array = malloc(size);
+		mr_write_to_array_flags(heaplet, array, flags[i]);
+		mr_heaplet_t* read_heaplet = mr_read_from_array(array, size);
+		int number_of_elements = 0;
+		mr_crawl(read_heaplet, count_elements, &number_of_elements);
+		printf("Read back %i elements out of %i from %zu %s bytes instead of %zu\n", number_of_elements, LOOP_COUNT, size, names[i], raw_size);
+		mr_free(read_heaplet);
+		free(array);
+	}
+
+	// Packed heaplets which change are written whole by mr_sync
+	FILE* f = fopen("test2.mr", "w");
+	mr_write_to_file_flags(heaplet, f, MR_WRITE_COMPRESS);
+	fclose(f);
+	char* found = mr_find_prefix(heaplet, sizeof(element), "element-1234", 13);
+	found[0] = 'E';
+	mr_touch(heaplet, found, 1);
+	mr_add_data(heaplet, sizeof(element), element);
+	int fd = open("test2.mr", O_RDWR);
+	mr_sync(heaplet, fd);
+	close(fd);
+	f = fopen("test2.mr", "r");
+	mr_heaplet_t* synced_heaplet = mr_read_from_file(f);
+	fclose(f);
+	int number_of_elements = 0;
+	mr_crawl(synced_heaplet, count_elements, &number_of_elements);
+	printf("%s, %i elements out of %i\n", mr_find_prefix(synced_heaplet, sizeof(element), "Element-1234", 13) != NULL ? "Synced change found" : "Synced change not found", number_of_elements, LOOP_COUNT + 1);
+	mr_free(synced_heaplet);
+	mr_free(heaplet);
+}
+
+static void batch_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	mr_add_data(heaplet, strlen("first"), "first");
+	char* names[LOOP_COUNT];
+	struct iovec items[LOOP_COUNT];
+	for (int i=0; i<LOOP_COUNT; i++) {
+		names[i] = malloc(32);
+		snprintf(names[i], 32, "item-%i", i);
+		items[i].iov_base = names[i];
+		items[i].iov_len = strlen(names[i]) + i % 7;
+	}
+	mr_add_datav(heaplet, items, LOOP_COUNT);
+	int number_of_elements = 0;
+	mr_crawl(heaplet, count_elements, &number_of_elements);
+	bool found = mr_find_prefix(heaplet, strlen("item-1234") + 1234 % 7, "item-1234", 9) != NULL;
+	printf("Added %i elements out of %i in a batch, %s\n", number_of_elements - 1, LOOP_COUNT, found ? "found one" : "not found");
+	for (int i=0; i<LOOP_COUNT; i++) {
+		free(names[i]);
+	}
+
+	uint64_t* records = malloc(sizeof(uint64_t) * 10 * LOOP_COUNT);
+	for (int i=0; i<10*LOOP_COUNT; i++) {
+		records[i] = i;
+	}
+	mr_heaplet_t* used[64];
+	size_t used_count = mr_add_bulk(heaplet, sizeof(uint64_t), records, 10 * LOOP_COUNT, used, 64);
+	uint64_t last = 10 * LOOP_COUNT - 1;
+	printf("Added %i records in %zu heaplets, %s\n", 10 * LOOP_COUNT, used_count, mr_find(used[used_count < 64 ? used_count - 1 : 63], sizeof(uint64_t), 0, &last, sizeof(uint64_t)) != NULL ? "found the last one" : "last one not found");
+	free(records);
+	mr_free(heaplet);
+}
+
+static void reserve_test(void) {
+	mr_heaplet_t* heaplet = mr_new();
+	mr_heaplet_t* used;
+	char* element = mr_reserve(heaplet, GARBAGE_SIZE, &used);
+	snprintf(element, GARBAGE_SIZE, "built in place");
+	mr_commit(used, element, strlen(element) + 1);
+	char* aborted = mr_reserve(heaplet, GARBAGE_SIZE, &used);
+	aborted[0] = 'x';
+	mr_abort(used, aborted);
+	char* late = mr_reserve(heaplet, GARBAGE_SIZE, &used);
+	mr_add_data(used, 4, "last");
+	bool refused = !mr_abort(used, late);
+	refused = refused && !mr_commit(used, mr_find(used, 4, 0, "last", 4), 4); // Added, not reserved
+	int number_of_elements = 0;
+	mr_crawl(heaplet, count_elements, &number_of_elements);
+	printf("%s, %i elements out of 3, %s\n", mr_find(heaplet, strlen("built in place") + 1, 0, "built in place", 14) != NULL ? "Found an element built in place" : "Element built in place not found", number_of_elements, refused ? "refused to abort an element which is not the last one" : "aborted an element which is not the last one");
+	mr_free(heaplet);
 }
 
 int main(void) {
 	srand(time(NULL));
 	basic_test();
 	serialize_test();
+	placement_test();
+	sizing_test();
+	concurrent_test();
+	compact_test();
+	stats_test();
+	keyed_test();
+	reader_test();
+	subtree_test();
+	compression_test();
+	batch_test();
+	reserve_test();
 	return 0;
 }
 